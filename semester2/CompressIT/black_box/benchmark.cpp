@@ -0,0 +1,399 @@
+// Throughput of every stage of both binaries and the compression ratio on a corpus:
+//     g++ -O2 -std=c++11 -pthread -o benchmark benchmark.cpp
+//     ./benchmark [--size SIZE] [--block-size SIZE] [--bwt sais|doubling] [--repeat N] [FILE...]
+// Without files it generates English-like text, repetitive logs, random bytes and long runs.
+// Every block goes through the stages one by one and each inverse stage is checked against
+// the input of its forward stage, the best time over the repeats is reported.
+#include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
+#include <exception>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <iomanip>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+#define COMPRESSIT_NO_MAIN
+namespace compression {
+#include "compressor.cpp"
+}
+namespace decompression {
+#include "decompressor.cpp"
+}
+
+using namespace std;
+
+enum BenchmarkStage {
+    BENCHMARK_BWT, BENCHMARK_MTF, BENCHMARK_ZERO_RUNS, BENCHMARK_HAFFMAN, BENCHMARK_ANS,
+    BENCHMARK_HAFFMAN_DECODE, BENCHMARK_ANS_DECODE, BENCHMARK_ZERO_RUNS_DECODE, BENCHMARK_MTF_DECODE,
+    BENCHMARK_BWT_DECODE, BENCHMARK_COMPRESS, BENCHMARK_DECOMPRESS, BENCHMARK_STAGE_COUNT
+};
+const char *const BENCHMARK_STAGE_NAMES[BENCHMARK_STAGE_COUNT] = {
+    "bwt", "mtf", "zero runs", "haffman", "ans",
+    "haffman decode", "ans decode", "zero runs decode", "mtf decode",
+    "bwt decode", "compress", "decompress"
+};
+
+struct BenchmarkOptions {
+    long long sampleSize;
+    int blockSize;
+    string suffarrayBuilder;
+    int repeats;
+    vector<string> files;
+
+    BenchmarkOptions() : sampleSize(4 << 20), blockSize(compression::DEFAULT_BLOCK_SIZE), suffarrayBuilder("sais"),
+                         repeats(3) {
+    }
+};
+
+struct Sample {
+    string name;
+    string data;
+};
+
+struct SampleResult {
+    double seconds[BENCHMARK_STAGE_COUNT];
+    uint64_t compressedSize;
+};
+
+
+// Words follow Zipf's law over a vocabulary drawn with English letter frequencies.
+string generateText(size_t size, mt19937 &random) {
+    const string LETTERS = "eeeeeeeeeeeetttttttttaaaaaaaaooooooooiiiiiiinnnnnnnsssssshhhhhhrrrrrrddddllllcccuuummwwffggyyppbbvk";
+    vector<string> vocabulary(4000);
+    for (size_t i = 0; i < vocabulary.size(); ++i) {
+        int length = 1 + random() % 3 + random() % 7;
+        for (int j = 0; j < length; ++j) {
+            vocabulary[i] += LETTERS[random() % LETTERS.size()];
+        }
+    }
+    vector<double> weights(vocabulary.size());
+    for (size_t i = 0; i < weights.size(); ++i) {
+        weights[i] = 1.0 / (i + 1);
+    }
+    discrete_distribution<int> word(weights.begin(), weights.end());
+
+    string text;
+    bool sentenceStart = true;
+    while (text.size() < size) {
+        string next = vocabulary[word(random)];
+        if (sentenceStart) {
+            next[0] = toupper(next[0]);
+            sentenceStart = false;
+        }
+        text += next;
+        int mark = random() % 24;
+        if (mark == 0) {
+            text += ".\n";
+            sentenceStart = true;
+        }
+        else if (mark == 1) {
+            text += ". ";
+            sentenceStart = true;
+        }
+        else if (mark == 2) {
+            text += ", ";
+        }
+        else {
+            text += ' ';
+        }
+    }
+    text.resize(size);
+    return text;
+}
+
+// Service log lines: timestamps growing by small steps, a handful of levels, paths and statuses.
+string generateLogs(size_t size, mt19937 &random) {
+    const char *const LEVELS[] = { "INFO ", "INFO ", "INFO ", "DEBUG", "WARN ", "ERROR" };
+    const char *const PATHS[] = { "/api/v1/items", "/api/v1/users", "/api/v1/orders", "/health", "/static/app.js" };
+    const int STATUSES[] = { 200, 200, 200, 200, 201, 304, 404, 500 };
+
+    string logs;
+    long long milliseconds = 36000000, request = 100000;
+    char line[256];
+    while (logs.size() < size) {
+        milliseconds += random() % 40;
+        long long seconds = milliseconds / 1000;
+        snprintf(line, sizeof(line),
+                 "2024-05-17 %02lld:%02lld:%02lld.%03lld %s [worker-%d] request=%lld path=%s/%d status=%d time=%dms\n",
+                 seconds / 3600 % 24, seconds / 60 % 60, seconds % 60, milliseconds % 1000, LEVELS[random() % 6],
+                 (int)(random() % 8), request++, PATHS[random() % 5], (int)(random() % 10000),
+                 STATUSES[random() % 8], (int)(random() % 250));
+        logs += line;
+    }
+    logs.resize(size);
+    return logs;
+}
+
+string generateRandom(size_t size, mt19937 &random) {
+    string bytes(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        bytes[i] = (char)random();
+    }
+    return bytes;
+}
+
+// Runs of a few symbols with lengths up to 64K, the worst case of naive suffix sorting.
+string generateRuns(size_t size, mt19937 &random) {
+    string runs;
+    while (runs.size() < size) {
+        size_t length = 1 + random() % (1 << (random() % 17));
+        runs.append(std::min(length, size - runs.size()), "ab\n\0"[random() % 4]);
+    }
+    return runs;
+}
+
+string readWholeFile(const string &path) {
+    ifstream inputStream(path, std::ios::binary | std::ios::in);
+    if (!inputStream) {
+        throw runtime_error("cannot open " + path);
+    }
+    ostringstream contents;
+    contents << inputStream.rdbuf();
+    return contents.str();
+}
+
+
+class StageBenchmark {
+private:
+    string suffarrayBuilder;
+    double seconds[BENCHMARK_STAGE_COUNT];
+    uint64_t compressedSize;
+
+    chrono::steady_clock::time_point stageStart;
+
+private:
+    void startStage() {
+        stageStart = chrono::steady_clock::now();
+    }
+    void finishStage(BenchmarkStage stage) {
+        seconds[stage] += chrono::duration<double>(chrono::steady_clock::now() - stageStart).count();
+    }
+    static void check(bool restored, BenchmarkStage stage) {
+        if (!restored) {
+            throw runtime_error(string(BENCHMARK_STAGE_NAMES[stage]) + " does not restore its input");
+        }
+    }
+    void runStages(const string &block);
+    void runRoundTrip(const string &block);
+
+public:
+    explicit StageBenchmark(const string &builder) : suffarrayBuilder(builder) {
+    }
+    SampleResult run(const string &data, int blockSize);
+};
+
+void StageBenchmark::runStages(const string &block) {
+    compression::BarrowsWillerTransformator BWT;
+    compression::MoveToFrontTransformator MTFT;
+    compression::ZeroRunLengthCoder zeroRunLengthCoder;
+    compression::HaffmanCoder haffmanCoder;
+    compression::AnsCoder ansCoder;
+    BWT.setSuffarrayBuilder(suffarrayBuilder);
+
+    startStage();
+    string transformedByBWTString = BWT.transform(block);
+    finishStage(BENCHMARK_BWT);
+
+    startStage();
+    string transformedByMTFString = MTFT.transform(transformedByBWTString);
+    finishStage(BENCHMARK_MTF);
+
+    startStage();
+    vector<uint16_t> symbols;
+    zeroRunLengthCoder.transform(transformedByMTFString, symbols);
+    finishStage(BENCHMARK_ZERO_RUNS);
+
+    ostringstream haffmanStream, ansStream;
+    startStage();
+    haffmanCoder.code(symbols, compression::ZERO_RUN_ALPHABET_SIZE);
+    haffmanCoder.outputCodedData(haffmanStream);
+    finishStage(BENCHMARK_HAFFMAN);
+
+    startStage();
+    ansCoder.code(symbols, compression::ZERO_RUN_ALPHABET_SIZE);
+    ansCoder.outputCodedData(ansStream);
+    finishStage(BENCHMARK_ANS);
+
+    decompression::HaffmanCoder haffmanDecoder;
+    decompression::AnsCoder ansDecoder;
+    decompression::ZeroRunLengthCoder zeroRunLengthDecoder;
+    decompression::MoveToFrontTransformator MTFDecoder;
+    decompression::BarrowsWillerTransformator BWTDecoder;
+
+    istringstream haffmanInput(haffmanStream.str()), ansInput(ansStream.str());
+    startStage();
+    haffmanDecoder.inputCodedData(haffmanInput, block.size());
+    haffmanDecoder.decode();
+    finishStage(BENCHMARK_HAFFMAN_DECODE);
+    check(haffmanDecoder.getDecodedText() == symbols, BENCHMARK_HAFFMAN_DECODE);
+
+    startStage();
+    ansDecoder.inputCodedData(ansInput, block.size());
+    ansDecoder.decode();
+    finishStage(BENCHMARK_ANS_DECODE);
+    check(ansDecoder.getDecodedText() == symbols, BENCHMARK_ANS_DECODE);
+
+    startStage();
+    string ranks;
+    zeroRunLengthDecoder.decode(symbols, ranks, block.size());
+    finishStage(BENCHMARK_ZERO_RUNS_DECODE);
+    check(ranks == transformedByMTFString, BENCHMARK_ZERO_RUNS_DECODE);
+
+    startStage();
+    string decodedFromMTFTString = MTFDecoder.decode(transformedByMTFString);
+    finishStage(BENCHMARK_MTF_DECODE);
+    check(decodedFromMTFTString == transformedByBWTString, BENCHMARK_MTF_DECODE);
+
+    const vector<int> &walkStarts = BWT.getWalkStarts();
+    BWTDecoder.setWalkStarts(vector<uint32_t>(walkStarts.begin(), walkStarts.end()));
+    startStage();
+    string decodedString = BWTDecoder.decode(transformedByBWTString);
+    finishStage(BENCHMARK_BWT_DECODE);
+    check(decodedString == block, BENCHMARK_BWT_DECODE);
+}
+
+// The frames the binaries would write, with the entropy coder picked per block.
+void StageBenchmark::runRoundTrip(const string &block) {
+    compression::BlockCompressor blockCompressor;
+    decompression::BlockDecompressor blockDecompressor;
+    blockCompressor.setSuffarrayBuilder(suffarrayBuilder);
+
+    startStage();
+    compression::CompressedFrame frame;
+    blockCompressor.compressBlock(block, frame);
+    finishStage(BENCHMARK_COMPRESS);
+    compressedSize += frame.data.size();
+
+    istringstream frameStream(frame.data);
+    startStage();
+    const string &decompressedText = blockDecompressor.decompressFrame(frameStream);
+    finishStage(BENCHMARK_DECOMPRESS);
+    check(decompressedText == block, BENCHMARK_DECOMPRESS);
+}
+
+SampleResult StageBenchmark::run(const string &data, int blockSize) {
+    fill(seconds, seconds + BENCHMARK_STAGE_COUNT, 0.0);
+    compressedSize = 0;
+    for (size_t offset = 0; offset < data.size(); offset += blockSize) {
+        string block = data.substr(offset, blockSize);
+        runStages(block);
+        runRoundTrip(block);
+    }
+
+    SampleResult result;
+    copy(seconds, seconds + BENCHMARK_STAGE_COUNT, result.seconds);
+    // the frame index: three numbers per frame and the trailer
+    uint64_t frames = (data.size() + blockSize - 1) / blockSize;
+    result.compressedSize = compressedSize + 24 * frames + 20;
+    return result;
+}
+
+
+void printResult(const Sample &sample, const SampleResult &result) {
+    double megabytes = sample.data.size() / 1e6;
+    cout << sample.name << ": " << sample.data.size() << " -> " << result.compressedSize << " bytes, ratio "
+         << fixed << setprecision(3) << (double)sample.data.size() / std::max<uint64_t>(result.compressedSize, 1)
+         << ", " << setprecision(3) << 8.0 * result.compressedSize / std::max<size_t>(sample.data.size(), 1)
+         << " bits per byte" << endl;
+    for (int stage = 0; stage < BENCHMARK_STAGE_COUNT; ++stage) {
+        cout << "    " << left << setw(18) << BENCHMARK_STAGE_NAMES[stage] << right << setw(10) << setprecision(1)
+             << megabytes / std::max(result.seconds[stage], 1e-9) << " MB/s" << endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; ++i) {
+        string argument = argv[i];
+        if (argument[0] != '-') {
+            options.files.push_back(argument);
+        }
+        else if (argument == "--size" && i + 1 < argc) {
+            options.sampleSize = compression::parseSize(argv[++i]);
+        }
+        else if (argument == "--block-size" && i + 1 < argc) {
+            options.blockSize = (int)std::min(compression::parseSize(argv[++i]),
+                                              (long long)compression::MAX_BLOCK_SIZE + 1);
+        }
+        else if (argument == "--bwt" && i + 1 < argc) {
+            options.suffarrayBuilder = argv[++i];
+        }
+        else if (argument == "--repeat" && i + 1 < argc) {
+            options.repeats = atoi(argv[++i]);
+        }
+        else {
+            cerr << "usage: " << argv[0] << " [--size SIZE] [--block-size SIZE] [--bwt sais|doubling]"
+                 << " [--repeat N] [FILE...]" << endl;
+            return 1;
+        }
+    }
+    if (options.blockSize < compression::MIN_BLOCK_SIZE || options.blockSize > compression::MAX_BLOCK_SIZE) {
+        cerr << "block size must be between 1K and 64M" << endl;
+        return 1;
+    }
+    if (options.suffarrayBuilder != "sais" && options.suffarrayBuilder != "doubling") {
+        cerr << "unknown BWT builder: " << options.suffarrayBuilder << endl;
+        return 1;
+    }
+    if (options.repeats < 1 || options.sampleSize < 1) {
+        cerr << "repeat count and sample size must be positive" << endl;
+        return 1;
+    }
+
+    try {
+        vector<Sample> samples;
+        if (options.files.empty()) {
+            mt19937 random(2024);
+            samples.push_back({ "text", generateText(options.sampleSize, random) });
+            samples.push_back({ "logs", generateLogs(options.sampleSize, random) });
+            samples.push_back({ "random", generateRandom(options.sampleSize, random) });
+            samples.push_back({ "runs", generateRuns(options.sampleSize, random) });
+        }
+        for (size_t i = 0; i < options.files.size(); ++i) {
+            samples.push_back({ options.files[i], readWholeFile(options.files[i]) });
+        }
+
+        StageBenchmark benchmark(options.suffarrayBuilder);
+        for (size_t i = 0; i < samples.size(); ++i) {
+            SampleResult best = benchmark.run(samples[i].data, options.blockSize);
+            for (int repeat = 1; repeat < options.repeats; ++repeat) {
+                SampleResult result = benchmark.run(samples[i].data, options.blockSize);
+                for (int stage = 0; stage < BENCHMARK_STAGE_COUNT; ++stage) {
+                    best.seconds[stage] = std::min(best.seconds[stage], result.seconds[stage]);
+                }
+            }
+            printResult(samples[i], best);
+        }
+    }
+    catch (const exception &error) {
+        cerr << error.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,359 @@
+// What compressor.cpp and decompressor.cpp share: the heap counters, CRC32C of the blocks,
+// the buffered output file and the --stats json report. Each of them includes this file after
+// its own stage list (STAGE_COUNT and STAGE_NAMES) and the standard headers. There is no include
+// guard: benchmark.cpp includes both binaries into their own namespaces, each gets its own copy.
+
+// Every heap block carries its size in front of it, so the counters see each allocation
+// and release. Stages reset the peak to the live size when they start and read it at the end.
+atomic<long long> liveHeapBytes(0);
+atomic<long long> peakHeapBytes(0);
+// Peak of the whole run, never reset by the stages. --memory-limit is checked against it.
+atomic<long long> runPeakHeapBytes(0);
+const size_t HEAP_HEADER_SIZE = 16;
+
+void raiseHeapPeak(atomic<long long> &peakBytes, long long live) {
+    long long peak = peakBytes.load(memory_order_relaxed);
+    while (live > peak && !peakBytes.compare_exchange_weak(peak, live, memory_order_relaxed)) {
+    }
+}
+
+// Replacing the global operators belongs to the binary, not to programs including the file,
+// unless they define COMPRESSIT_COUNT_HEAP to measure the heap as well.
+#if !defined(COMPRESSIT_NO_MAIN) || defined(COMPRESSIT_COUNT_HEAP)
+__attribute__((noinline)) void *operator new(size_t size) {
+    char *block = (char *)malloc(size + HEAP_HEADER_SIZE);
+    if (block == NULL) {
+        throw bad_alloc();
+    }
+    *(size_t *)block = size;
+    long long live = liveHeapBytes += size;
+    raiseHeapPeak(peakHeapBytes, live);
+    raiseHeapPeak(runPeakHeapBytes, live);
+    return block + HEAP_HEADER_SIZE;
+}
+
+__attribute__((noinline)) void operator delete(void *pointer) noexcept {
+    if (pointer == NULL) {
+        return;
+    }
+    char *block = (char *)pointer - HEAP_HEADER_SIZE;
+    liveHeapBytes -= *(size_t *)block;
+    free(block);
+}
+
+// C++14 calls this one when the size is known, the size in the header is used all the same.
+__attribute__((noinline)) void operator delete(void *pointer, size_t) noexcept {
+    operator delete(pointer);
+}
+#endif
+
+// CRC32C (Castagnoli) of every block, stored in its frame header. The SSE4.2 crc32
+// instruction takes 8 bytes at a time when the processor has it, otherwise slicing-by-8
+// tables do the same with eight lookups.
+class Crc32c {
+private:
+    uint32_t table[8][256];
+    bool hardware;
+
+private:
+    uint32_t updateSoftware(uint32_t crc, const unsigned char *data, size_t size) const;
+#ifdef __x86_64__
+    static uint32_t updateHardware(uint32_t crc, const unsigned char *data, size_t size);
+#endif
+
+public:
+    // Without allowHardware the tables are used even where SSE4.2 is there, for the tests.
+    explicit Crc32c(bool allowHardware = true);
+    uint32_t compute(const char *data, size_t size) const;
+};
+
+Crc32c::Crc32c(bool allowHardware) {
+    const uint32_t POLYNOMIAL = 0x82F63B78;
+    for (int i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ ((crc & 1) ? POLYNOMIAL : 0);
+        }
+        table[0][i] = crc;
+    }
+    // table[k][i] is the CRC of byte i followed by k zero bytes
+    for (int k = 1; k < 8; ++k) {
+        for (int i = 0; i < 256; ++i) {
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+        }
+    }
+#ifdef __x86_64__
+    hardware = allowHardware && __builtin_cpu_supports("sse4.2");
+#else
+    hardware = false;
+#endif
+}
+
+// Words are loaded as little-endian, as on every host with SSE4.2 anyway.
+uint32_t Crc32c::updateSoftware(uint32_t crc, const unsigned char *data, size_t size) const {
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^ table[5][(word >> 16) & 0xFF]
+              ^ table[4][(word >> 24) & 0xFF] ^ table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF]
+              ^ table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+    }
+    for (; size > 0; ++data, --size) {
+        crc = table[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+uint32_t Crc32c::updateHardware(uint32_t crc, const unsigned char *data, size_t size) {
+    uint64_t wideCrc = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wideCrc = _mm_crc32_u64(wideCrc, word);
+    }
+    crc = (uint32_t)wideCrc;
+    for (; size > 0; ++data, --size) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+uint32_t Crc32c::compute(const char *data, size_t size) const {
+    const unsigned char *bytes = (const unsigned char *)data;
+#ifdef __x86_64__
+    if (hardware) {
+        return ~updateHardware(~0u, bytes, size);
+    }
+#endif
+    return ~updateSoftware(~0u, bytes, size);
+}
+
+// Collects the output in a large page-aligned buffer and passes it on with one write call
+// per buffer, writes bigger than the buffer go straight through. "-" stands for the standard output.
+class OutputFileBuffer : public streambuf {
+private:
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+    int descriptor;
+    bool ownsDescriptor;
+    bool seekable;
+    char *buffer;
+
+private:
+    void allocateBuffer();
+    void checkSeekable();
+    void writeAll(const char *data, size_t size);
+    void flushBuffer();
+
+protected:
+    virtual int_type overflow(int_type symbol);
+    virtual streamsize xsputn(const char *data, streamsize count);
+    virtual int sync();
+
+public:
+    OutputFileBuffer() : descriptor(-1), ownsDescriptor(false), seekable(false), buffer(NULL) {
+    }
+    // Write errors reach only those calling close, the destructor may run during unwinding.
+    ~OutputFileBuffer() {
+        try {
+            close();
+        }
+        catch (const exception &) {
+        }
+    }
+    void open(const string &path);
+    // Writes into an existing file from the given offset on, nothing of it is cut.
+    void openAt(const string &path, uint64_t offset);
+    // Only a regular file written from offset zero on takes data at any offset, pipes, FIFOs
+    // and terminals take it in order, even when opened by path like /dev/stdout.
+    bool isSeekable() const {
+        return seekable;
+    }
+    // Places data at the given offset of the file bypassing the buffer, safe from several threads.
+    void writeAt(uint64_t offset, const char *data, size_t size);
+    void close();
+};
+
+void OutputFileBuffer::open(const string &path) {
+    close();
+    if (path == "-") {
+        descriptor = STDOUT_FILENO;
+    }
+    else {
+        descriptor = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (descriptor < 0) {
+            throw runtime_error("cannot open " + path + ": " + strerror(errno));
+        }
+        ownsDescriptor = true;
+    }
+    checkSeekable();
+    allocateBuffer();
+}
+
+void OutputFileBuffer::openAt(const string &path, uint64_t offset) {
+    close();
+    descriptor = ::open(path.c_str(), O_WRONLY);
+    if (descriptor < 0) {
+        throw runtime_error("cannot open " + path + ": " + strerror(errno));
+    }
+    ownsDescriptor = true;
+    if (lseek(descriptor, offset, SEEK_SET) < 0) {
+        throw runtime_error("cannot seek in " + path + ": " + strerror(errno));
+    }
+    checkSeekable();
+    allocateBuffer();
+}
+
+// pwrite ignores the file position, and Linux appends its data to a file opened with O_APPEND.
+void OutputFileBuffer::checkSeekable() {
+    struct stat status;
+    int flags = fcntl(descriptor, F_GETFL);
+    seekable = fstat(descriptor, &status) == 0 && S_ISREG(status.st_mode) && flags >= 0 && !(flags & O_APPEND)
+               && lseek(descriptor, 0, SEEK_CUR) == 0;
+}
+
+void OutputFileBuffer::allocateBuffer() {
+    void *address;
+    if (posix_memalign(&address, sysconf(_SC_PAGESIZE), BUFFER_SIZE) != 0) {
+        throw runtime_error("cannot allocate the output buffer");
+    }
+    buffer = (char *)address;
+    setp(buffer, buffer + BUFFER_SIZE);
+}
+
+void OutputFileBuffer::writeAll(const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t count = ::write(descriptor, data, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            throw runtime_error(string("cannot write the output: ") + strerror(errno));
+        }
+        data += count;
+        size -= count;
+    }
+}
+
+void OutputFileBuffer::writeAt(uint64_t offset, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t count = pwrite(descriptor, data, size, offset);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            throw runtime_error(string("cannot write the output: ") + strerror(errno));
+        }
+        data += count;
+        size -= count;
+        offset += count;
+    }
+}
+
+// The buffer is emptied before the write, so data that failed to go out is not retried by close.
+void OutputFileBuffer::flushBuffer() {
+    size_t size = pptr() - pbase();
+    setp(buffer, buffer + BUFFER_SIZE);
+    writeAll(buffer, size);
+}
+
+OutputFileBuffer::int_type OutputFileBuffer::overflow(int_type symbol) {
+    flushBuffer();
+    if (!traits_type::eq_int_type(symbol, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(symbol);
+        pbump(1);
+    }
+    return traits_type::not_eof(symbol);
+}
+
+streamsize OutputFileBuffer::xsputn(const char *data, streamsize count) {
+    if (count <= epptr() - pptr()) {
+        memcpy(pptr(), data, count);
+        pbump(count);
+        return count;
+    }
+    flushBuffer();
+    if (count >= (streamsize)BUFFER_SIZE) {
+        writeAll(data, count);
+    }
+    else {
+        memcpy(pptr(), data, count);
+        pbump(count);
+    }
+    return count;
+}
+
+int OutputFileBuffer::sync() {
+    flushBuffer();
+    return 0;
+}
+
+// The buffer and the file are released even if the last write fails, its error is rethrown after.
+void OutputFileBuffer::close() {
+    exception_ptr writeError;
+    if (buffer != NULL) {
+        try {
+            flushBuffer();
+        }
+        catch (...) {
+            writeError = current_exception();
+        }
+        free(buffer);
+        buffer = NULL;
+        setp(NULL, NULL);
+    }
+    if (ownsDescriptor) {
+        ::close(descriptor);
+    }
+    descriptor = -1;
+    ownsDescriptor = false;
+    seekable = false;
+    if (writeError) {
+        rethrow_exception(writeError);
+    }
+}
+
+struct StageStats {
+    double seconds;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    long long peakHeapBytes;
+};
+
+// What --stats json reports about a block.
+struct BlockStats {
+    StageStats stages[STAGE_COUNT];
+    uint32_t primaryIndex;
+    int distinctSymbols;
+    // bits per coded symbol, without the table
+    double averageCodeLength;
+    int entropyCoderId;
+};
+
+// One object per block with the stages in pipeline order, written to stderr
+// since stdout may carry the output.
+void printStatsJson(ostream &outputStream, const vector<BlockStats> &blockStats) {
+    outputStream << "{\"blocks\": [";
+    for (size_t i = 0; i < blockStats.size(); ++i) {
+        const BlockStats &stats = blockStats[i];
+        outputStream << (i == 0 ? "\n" : ",\n") << "  {\"block\": " << i
+                     << ", \"bwt_primary_index\": " << stats.primaryIndex
+                     << ", \"distinct_symbols\": " << stats.distinctSymbols
+                     << ", \"entropy_coder\": \"" << (stats.entropyCoderId == ENTROPY_ANS ? "ans" : "haffman") << "\""
+                     << ", \"average_code_length\": " << stats.averageCodeLength << ", \"stages\": {";
+        for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+            const StageStats &stageStats = stats.stages[stage];
+            outputStream << (stage == 0 ? "" : ", ") << "\"" << STAGE_NAMES[stage] << "\": {"
+                         << "\"seconds\": " << stageStats.seconds
+                         << ", \"bytes_in\": " << stageStats.bytesIn
+                         << ", \"bytes_out\": " << stageStats.bytesOut
+                         << ", \"peak_heap_bytes\": " << stageStats.peakHeapBytes << "}";
+        }
+        outputStream << "}}";
+    }
+    outputStream << "\n]}" << endl;
+}
@@ -1,113 +1,595 @@
 #include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <queue>
-#include <unordered_map>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <sys/resource.h>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
 
 using namespace std;
 
-const int C_SIZE = sizeof ((char)1);
-const string ALLOWED_SYMBOLS = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ ()':,.!?\"";
-const int ALPHABET_SIZE = ALLOWED_SYMBOLS.size();
+// Any byte is a symbol, symbol tables are flat arrays indexed by the byte value.
+const int ALPHABET_SIZE = 256;
+// After zero-run coding: RUNA, RUNB and the MTF ranks 1..255 shifted by one.
+const int RUN_A = 0;
+const int RUN_B = 1;
+const int ZERO_RUN_ALPHABET_SIZE = ALPHABET_SIZE + 1;
 
-unordered_map<char, int> symbolToIndex;
+const int FRAME_FLAG_ZERO_RUNS = 1;
 
+// Entropy coder ids stored in every frame header.
+const int ENTROPY_HAFFMAN = 0;
+const int ENTROPY_ANS = 1;
+
+const int ANS_TABLE_LOG = 11;
+
+// Longer codes are rebalanced by package-merge, so the decoder needs two table levels at most.
+const int HAFFMAN_MAX_CODE_LENGTH = 20;
+
+// Rows of the rotations starting at k * n / BWT_WALKS are stored in the frame,
+// so the decompressor can run that many independent inverse BWT walks at once.
+const int BWT_WALKS = 8;
+
+const int MIN_BLOCK_SIZE = 1 << 10;
+const int MAX_BLOCK_SIZE = 64 << 20;
+const int DEFAULT_BLOCK_SIZE = 900 << 10;
+
+const string ARCHIVE_MAGIC = "CIT1";
+// The same trailer in archives written with an FM-index sidecar, appends to them must grow it too.
+const string FM_INDEXED_ARCHIVE_MAGIC = "CIF1";
+
+// Archives of records keep a table of record lengths between the last frame and the frame
+// index: LEB128 lengths, then u64 record count, u64 table offset and the magic.
+const string RECORD_TABLE_MAGIC = "CRT1";
+
+// FM-index sidecar: per block, symbol counts of the BWT every FM_RANK_INTERVAL rows and
+// the suffix array at every FM_SAMPLE_RATE-th text position.
+const string FM_INDEX_MAGIC = "CFM1";
+const int FM_RANK_INTERVAL = 2048;
+const int FM_SAMPLE_RATE = 64;
+
+// Memory model of --memory-limit, see estimateMemory.
+const long long SAIS_BYTES_PER_SYMBOL = 36;
+const long long DOUBLING_BYTES_PER_SYMBOL = 36;
+// Resident above the heap peak with 1K blocks: code, libraries, the output buffer and the
+// input pages, about 4M. Every further worker added some 100K of coder tables and stack.
+const long long FIXED_MEMORY = 5 << 20;
+const long long THREAD_MEMORY = 256 << 10;
+
+// Stages of a block whose heap peaks are reported by --memory-report.
+enum CompressionStage { STAGE_BWT, STAGE_MTF, STAGE_ZERO_RUNS, STAGE_ENTROPY, STAGE_FRAME, STAGE_COUNT };
+const char *const STAGE_NAMES[STAGE_COUNT] = { "bwt", "mtf", "zero-runs", "entropy", "frame" };
+
+struct CompressionOptions {
+    int blockSize;
+    string suffarrayBuilder;
+    int threads;
+    bool zeroRuns;
+    string entropyCoder;
+    long long memoryLimit;
+    bool memoryReport;
+    string statsFormat;
+    string fmIndexPath;
+    // every line of the input is a record of a batch
+    bool lineRecords;
+    // new frames go after those of the output archive if it exists
+    bool append;
+
+    CompressionOptions() : blockSize(DEFAULT_BLOCK_SIZE), suffarrayBuilder("sais"), threads(1), zeroRuns(true),
+                           entropyCoder("auto"), memoryLimit(0), memoryReport(false),
+                           lineRecords(false), append(false) {
+    }
+};
+
+void checkOptions(const CompressionOptions &options) {
+    if (options.blockSize < MIN_BLOCK_SIZE || options.blockSize > MAX_BLOCK_SIZE) {
+        throw runtime_error("block size must be between 1K and 64M");
+    }
+    if (options.suffarrayBuilder != "sais" && options.suffarrayBuilder != "doubling") {
+        throw runtime_error("unknown BWT builder: " + options.suffarrayBuilder);
+    }
+    if (options.entropyCoder != "auto" && options.entropyCoder != "haffman" && options.entropyCoder != "ans") {
+        throw runtime_error("unknown entropy coder: " + options.entropyCoder);
+    }
+    if (options.threads < 1) {
+        throw runtime_error("thread count must be positive, 0 picks one per core");
+    }
+    if (!options.statsFormat.empty() && options.statsFormat != "json") {
+        throw runtime_error("unknown stats format: " + options.statsFormat);
+    }
+}
+
+#include "common.h"
+
+// Little-endian, the byte order of every number in the archive.
+void writeUint(ostream &outputStream, uint64_t value, int bytes) {
+    for (int byte = 0; byte < bytes; ++byte) {
+        outputStream.put((char)(value >> (8 * byte)));
+    }
+}
+
+uint64_t readUint(istream &inputStream, int bytes) {
+    uint64_t value = 0;
+    for (int byte = 0; byte < bytes; ++byte) {
+        value |= (uint64_t)(unsigned char)inputStream.get() << (8 * byte);
+    }
+    return value;
+}
+
+// Packs bits starting from the lowest bit of every byte. Bits gather in a 64-bit
+// accumulator and leave it as whole 32-bit words into a buffer sized in advance.
+class BitWriter {
+private:
+    vector<char> buffer;
+    size_t bufferSize;
+    uint64_t accumulator;
+    int accumulatorBits;
+
+private:
+    void storeWord(uint32_t word) {
+        if (bufferSize + 4 > buffer.size()) {
+            buffer.resize(2 * buffer.size() + 4);
+        }
+        char *destination = &buffer[bufferSize];
+        destination[0] = (char)word;
+        destination[1] = (char)(word >> 8);
+        destination[2] = (char)(word >> 16);
+        destination[3] = (char)(word >> 24);
+        bufferSize += 4;
+    }
+
+public:
+    BitWriter() : bufferSize(0), accumulator(0), accumulatorBits(0) {
+    }
+    void reset(uint64_t expectedBits) {
+        buffer.resize(expectedBits / 8 + 8);
+        bufferSize = 0;
+        accumulator = 0;
+        accumulatorBits = 0;
+    }
+    void writeBits(uint64_t bits, int count) {
+        if (count > 32) {
+            writeBits(bits & 0xFFFFFFFFu, 32);
+            writeBits(bits >> 32, count - 32);
+            return;
+        }
+        accumulator |= bits << accumulatorBits;
+        accumulatorBits += count;
+        if (accumulatorBits >= 32) {
+            storeWord((uint32_t)accumulator);
+            accumulator >>= 32;
+            accumulatorBits -= 32;
+        }
+    }
+    // Writes out the tail, the last byte is padded with zero bits.
+    void flush() {
+        while (accumulatorBits > 0) {
+            if (bufferSize == buffer.size()) {
+                buffer.resize(2 * buffer.size() + 1);
+            }
+            buffer[bufferSize++] = (char)accumulator;
+            accumulator >>= 8;
+            accumulatorBits -= std::min(accumulatorBits, 8);
+        }
+        accumulator = 0;
+    }
+    const char *data() const {
+        return buffer.data();
+    }
+    size_t size() const {
+        return bufferSize;
+    }
+};
+
+// Hands the input out block by block.
+class IBlockSource {
+public:
+    // Reads at most blockSize bytes, returns false once the input is over.
+    virtual bool readBlock(string &block, size_t blockSize) = 0;
+    virtual ~IBlockSource() {
+    }
+};
+
+// Regular files are mapped into memory and handed out block by block, pipes and terminals
+// are read with large read calls. "-" stands for the standard input.
+class InputFile : public IBlockSource {
+private:
+    int descriptor;
+    bool ownsDescriptor;
+    const char *mapped;
+    size_t mappedSize;
+    size_t position;
+
+public:
+    InputFile() : descriptor(-1), ownsDescriptor(false), mapped(NULL), mappedSize(0), position(0) {
+    }
+    ~InputFile() {
+        close();
+    }
+    void open(const string &path);
+    bool readBlock(string &block, size_t blockSize);
+    void close();
+};
+
+// Input that is already in memory, the caller keeps it alive during the compression.
+class MemoryInput : public IBlockSource {
+private:
+    const uint8_t *data;
+    size_t size;
+    size_t position;
+
+public:
+    MemoryInput(const uint8_t *data, size_t size) : data(data), size(size), position(0) {
+    }
+    bool readBlock(string &block, size_t blockSize) {
+        size_t blockLength = std::min(blockSize, size - position);
+        block.assign((const char *)data + position, blockLength);
+        position += blockLength;
+        return position < size;
+    }
+};
+
+// Appends the output to a vector which grows as needed.
+class VectorOutputBuffer : public streambuf {
+private:
+    vector<uint8_t> &output;
+
+protected:
+    virtual int_type overflow(int_type symbol) {
+        if (!traits_type::eq_int_type(symbol, traits_type::eof())) {
+            output.push_back((uint8_t)traits_type::to_char_type(symbol));
+        }
+        return traits_type::not_eof(symbol);
+    }
+    virtual streamsize xsputn(const char *data, streamsize count) {
+        output.insert(output.end(), (const uint8_t *)data, (const uint8_t *)data + count);
+        return count;
+    }
+
+public:
+    explicit VectorOutputBuffer(vector<uint8_t> &output) : output(output) {
+    }
+};
+
+// Appends the output to a string, which keeps its capacity from the frames it held before.
+class StringOutputBuffer : public streambuf {
+private:
+    string &output;
+
+protected:
+    virtual int_type overflow(int_type symbol) {
+        if (!traits_type::eq_int_type(symbol, traits_type::eof())) {
+            output.push_back(traits_type::to_char_type(symbol));
+        }
+        return traits_type::not_eof(symbol);
+    }
+    virtual streamsize xsputn(const char *data, streamsize count) {
+        output.append(data, count);
+        return count;
+    }
+
+public:
+    explicit StringOutputBuffer(string &output) : output(output) {
+    }
+};
+
+// Fills a buffer of fixed capacity given by the caller, running out of it is an error.
+class ArrayOutputBuffer : public streambuf {
+protected:
+    virtual int_type overflow(int_type symbol) {
+        if (traits_type::eq_int_type(symbol, traits_type::eof())) {
+            return traits_type::not_eof(symbol);
+        }
+        throw runtime_error("output buffer is too small");
+    }
+
+public:
+    ArrayOutputBuffer(uint8_t *buffer, size_t capacity) {
+        setp((char *)buffer, (char *)buffer + capacity);
+    }
+    size_t size() const {
+        return pptr() - pbase();
+    }
+};
+
+// Builders order the cyclic rotations of the string, which is what BWT needs.
 template <typename size_type>
 class ISuffarayBuilder {
 public:
-    virtual vector<int> build(const string& s) = 0;
+    // Fills result with the sorted rotations, its capacity is reused from the previous block.
+    virtual void build(const string& s, vector<size_type> &result) = 0;
+    virtual ~ISuffarayBuilder() {
+    }
 };
 
+// Prefix doubling, O(n log n). The arrays of a round are swapped with the ones of the
+// previous round, so a block of a size seen before allocates nothing.
 template <typename size_type>
 class FastSuffixArrayBuilder : public ISuffarayBuilder<size_type> {
+private:
+    vector<size_type> class_num;
+    vector<size_type> new_class_num;
+    vector<size_type> classes_count;
+    vector<size_type> new_result;
+
 public:
-    virtual vector<size_type> build(const string& initialString);
+    virtual void build(const string& initialString, vector<size_type> &result);
+};
+
+// Induced sorting (SA-IS) over the block from its least rotation on, O(n). Every recursion
+// level keeps its arrays between blocks, the reduced problems are at most half as long as
+// the level above, and the first level sorts bytes straight into the caller's result.
+template <typename size_type>
+class SaisSuffixArrayBuilder : public ISuffarayBuilder<size_type> {
+private:
+    struct Level {
+        // suffix array of the reduced problem of the level above, unused on the first level
+        vector<size_type> result;
+        vector<bool> isSType;
+        // bucketStartL[c] is the first slot of the bucket of c, bucketStartS[c] is where its S-suffixes begin
+        vector<size_type> bucketStartL;
+        vector<size_type> bucketStartS;
+        vector<size_type> bucket;
+        vector<size_type> lmsPositions;
+        vector<size_type> sortedLms;
+        vector<size_type> reducedText;
+    };
+    // a deque keeps the levels in place while deeper ones are added
+    deque<Level> levels;
+    vector<unsigned char> rotatedText;
+
+private:
+    // Sizes vary a little from block to block, and a plain resize would double the capacity
+    // for a few more elements. These arrays grow to exactly the biggest size seen.
+    template <typename element_type>
+    static void resizeExactly(vector<element_type> &array, size_t size) {
+        if (size > array.capacity()) {
+            array.reserve(size);
+        }
+        array.resize(size);
+    }
+    static bool isLms(const vector<bool> &isSType, size_type position) {
+        return isSType[position] && !isSType[position - 1];
+    }
+    // the next LMS position after an LMS one, or the length
+    static size_type lmsEnd(const vector<bool> &isSType, size_type position) {
+        size_type length = isSType.size();
+        do {
+            ++position;
+        } while (position < length && !isLms(isSType, position));
+        return position;
+    }
+    template <typename text_type>
+    void induce(const text_type &text, Level &level, vector<size_type> &result, const vector<size_type> &lmsPositions);
+    template <typename text_type>
+    void buildSuffixArray(const text_type &text, size_type upper, size_t depth, vector<size_type> &result);
+
+public:
+    virtual void build(const string& initialString, vector<size_type> &result);
 };
 
 class BarrowsWillerTransformator {
 private:
     int initialStringIndex;
+    vector<int> walkStarts;
+    vector<int> suffarray;
+
+    FastSuffixArrayBuilder<int> doublingBuilder;
+    SaisSuffixArrayBuilder<int> saisBuilder;
+    ISuffarayBuilder<int> *suffarrayBuilder;
+
 public:
+    BarrowsWillerTransformator() : suffarrayBuilder(&saisBuilder) {
+    }
+    bool setSuffarrayBuilder(const string &name) {
+        if (name == "doubling") {
+            suffarrayBuilder = &doublingBuilder;
+        }
+        else if (name == "sais") {
+            suffarrayBuilder = &saisBuilder;
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
     string transform(const string &initialString);
+    // The same into the given string, which keeps its capacity between blocks.
+    void transform(const string &initialString, string &transformedString);
     int getInitialStringIndex() {
         return initialStringIndex;
     }
+    const vector<int> &getWalkStarts() {
+        return walkStarts;
+    }
+    // Suffix array of the last block, for the FM-index. Its memory is reused by the next block.
+    const vector<int> &getSuffarray() const {
+        return suffarray;
+    }
+};
+
+// Builds the FM-index sidecar record of a block. Counting and locating need only these
+// samples and the BWT, which the query tool gets back from the frame without inverting it.
+class FmIndexBuilder {
+private:
+    int findPeriod(const string &initialString, const vector<int> &suffarray, int primaryIndex);
+
+public:
+    string build(const string &initialString, const string &transformedString, const vector<int> &suffarray,
+                 int primaryIndex, uint32_t blockChecksum);
 };
 
+// The recency list is a flat 256-byte array: the rank is found by comparing
+// 16 bytes at a time and the symbol is moved to the front with one memmove.
 class MoveToFrontTransformator {
+private:
+    alignas(16) unsigned char recency[ALPHABET_SIZE];
+
+private:
+    int findRank(unsigned char symbol) const;
+
 public:
     string transform(const string &initialString);
+    void transform(const string &initialString, string &transformedString);
 };
 
-struct Node {
-    char symbol;
-    int count;
-    Node *leftSon;
-    Node *rightSon;
+// Zero runs of the MTF output written as bijective base-2 numbers over the digits RUNA = 1 and RUNB = 2,
+// as in bzip2. Other ranks are shifted by one to make room for the two digits.
+class ZeroRunLengthCoder {
+public:
+    void transform(const string &ranks, vector<uint16_t> &symbols);
+};
 
-    Node() : Node('#', 0, NULL, NULL) {
+// Codes the symbols of one block and writes the table it needs together with the coded bits.
+class IEntropyCoder {
+public:
+    virtual void code(const vector<uint16_t> &symbols, int symbolsAlphabetSize) = 0;
+    virtual void outputCodedData(ostream &outputStream) = 0;
+    virtual uint64_t codedSize() = 0;
+    // for --stats: count of symbols used in the block and bits spent on them
+    virtual int distinctSymbols() = 0;
+    virtual uint64_t codedBits() = 0;
+    virtual ~IEntropyCoder() {
     }
-    Node(const Node& other) : Node(other.symbol, other.count, other.leftSon, other.rightSon) {
+};
+
+class HaffmanCoder : public IEntropyCoder {
+private:
+    const vector<uint16_t> *text;
+    int alphabetSize;
+
+    vector<int> frequencyVocabulary;
+    vector<int> codeLengths;
+    // codes are stored bit-reversed, the first bit of a code is the lowest one
+    vector<uint64_t> displaySymbolToCode;
+    // used symbols sorted by frequency and the work arrays of the length computation
+    vector<int> sortedSymbols;
+    vector<long long> weights;
+    vector<long long> packageWeights;
+    vector<char> packageIsLeaf;
+
+    uint64_t totalCountBits;
+    BitWriter codedText;
+
+private:
+    void makeFrequencyVocabulary();
+    void makeCodeLengths();
+    void limitCodeLengths();
+    void makeDisplaySymbolToCode();
+    void codeText();
+
+public:
+    virtual void code(const vector<uint16_t> &symbols, int symbolsAlphabetSize) {
+        text = &symbols;
+        alphabetSize = symbolsAlphabetSize;
+
+        makeFrequencyVocabulary();
+        makeCodeLengths();
+        makeDisplaySymbolToCode();
+        codeText();
     }
-    Node(char s, int c) : Node(s, c, NULL, NULL) {
+    virtual void outputCodedData(ostream &outputStream);
+    virtual uint64_t codedSize();
+    virtual int distinctSymbols() {
+        return sortedSymbols.size();
     }
-    Node(char s, int c, Node *l, Node *r) : symbol(s), count(c), leftSon(l), rightSon(r) {
+    virtual uint64_t codedBits() {
+        return totalCountBits;
     }
 
-    bool operator <(const Node &other) const {
-        return other.count < count;
+    vector<char> getCodedText() {
+        return vector<char>(codedText.data(), codedText.data() + codedText.size());
+    }
+    const vector<int> &getCodeLengths() {
+        return codeLengths;
     }
 };
 
-class HaffmanCoder {
+// Table-based asymmetric numeral system coder (tANS, as in FSE). Frequencies are normalized
+// to a table of 2^ANS_TABLE_LOG states, so a symbol costs a fractional count of bits.
+class AnsCoder : public IEntropyCoder {
 private:
-    string text;
+    const vector<uint16_t> *text;
+    int alphabetSize;
 
     vector<int> frequencyVocabulary;
-    unordered_map<char, string> displaySymbolToCode;
-    Node *codeTreeRoot;
+    vector<int> normalizedCounts;
+    // states of every symbol in increasing order, symbol s owns [stateStart[s], stateStart[s + 1])
+    vector<int> stateStart;
+    vector<uint16_t> symbolStates;
+    // work arrays of makeStateTable, kept between blocks
+    vector<uint16_t> stateSymbol;
+    vector<int> nextState;
 
-    int totalCountBits;
-    vector<char> codedText;
+    vector<uint16_t> chunkBits;
+    vector<uint8_t> chunkLengths;
+    int finalState;
+    uint64_t totalCountBits;
+    BitWriter codedText;
 
 private:
     void makeFrequencyVocabulary();
-    void makeCodeTree();
-    void makeDisplaySymbolToCode(Node *currentNode, const string prefix);
+    void normalizeCounts();
+    void makeStateTable();
     void codeText();
 
 public:
-    void code(const string &initialString) {
-        totalCountBits = 0;
-        text = initialString;
+    virtual void code(const vector<uint16_t> &symbols, int symbolsAlphabetSize) {
+        text = &symbols;
+        alphabetSize = symbolsAlphabetSize;
 
         makeFrequencyVocabulary();
-        makeCodeTree();
-        makeDisplaySymbolToCode(codeTreeRoot, "");
+        normalizeCounts();
+        makeStateTable();
         codeText();
     }
-    void outputCodedData(ostream &outputStream);
-
-    vector<char> getCodedText() {
-        return codedText;
+    virtual void outputCodedData(ostream &outputStream);
+    virtual uint64_t codedSize();
+    virtual int distinctSymbols() {
+        return alphabetSize - count(frequencyVocabulary.begin(), frequencyVocabulary.end(), 0);
+    }
+    virtual uint64_t codedBits() {
+        return totalCountBits;
     }
 };
 
 template <typename size_type>
-vector<size_type> FastSuffixArrayBuilder<size_type>::build(const string& initialString) {
-    string tandemString = initialString;
+void FastSuffixArrayBuilder<size_type>::build(const string& initialString, vector<size_type> &result) {
+    const string &tandemString = initialString;
 
     size_type length = tandemString.size();
-    vector<size_type> result(length);
+    result.resize(length);
 
-    vector<size_type> class_num(length);
-    vector<size_type> classes_count(std::max(length, (size_type)ALPHABET_SIZE));
+    class_num.resize(length);
+    classes_count.assign(std::max(length, (size_type)ALPHABET_SIZE), 0);
     for (size_type i = 0; i < length; ++i) {
-        class_num[i] = symbolToIndex[tandemString[i]];
+        class_num[i] = (unsigned char)tandemString[i];
         classes_count[class_num[i]] += 1;
     }
-    for (size_type i = 1; i < classes_count.size(); ++i) {
+    for (size_t i = 1; i < classes_count.size(); ++i) {
         classes_count[i] += classes_count[i - 1];
     }
     for (size_type i = 0; i < length; ++i) {
@@ -116,6 +598,8 @@ vector<size_type> FastSuffixArrayBuilder<size_type>::build(const string& initial
         result[position] = i;
     }
 
+    new_result.resize(length);
+    new_class_num.resize(length);
     for (size_type level = 0; (1 << level) < length; ++level) {
         // invariant: suffixes of length (2^level) are correctly sorted
         size_type step = (1 << level);
@@ -123,11 +607,10 @@ vector<size_type> FastSuffixArrayBuilder<size_type>::build(const string& initial
         for (size_type i = 0; i < length; ++i) {
             classes_count[class_num[i]] += 1;
         }
-        for (size_type i = 1; i < classes_count.size(); ++i) {
+        for (size_t i = 1; i < classes_count.size(); ++i) {
             classes_count[i] += classes_count[i - 1];
         }
 
-        vector<size_type> new_result(length);
         for (size_type i = length - 1; i != -1; --i) {
             size_type second_position = result[i];
             size_type first_position = (second_position - step + length) % length;
@@ -136,9 +619,8 @@ vector<size_type> FastSuffixArrayBuilder<size_type>::build(const string& initial
             classes_count[class_num[first_position]] -= 1;
             new_result[position] = first_position;
         }
-        result = new_result;
+        result.swap(new_result);
 
-        vector<size_type> new_class_num(length);
         new_class_num[result[0]] = 0;
         for (size_type i = 1; i < length; ++i) {
             size_type prev_pos1 = result[i - 1], cur_pos1 = result[i];
@@ -151,215 +633,1823 @@ vector<size_type> FastSuffixArrayBuilder<size_type>::build(const string& initial
                 new_class_num[cur_pos1] = new_class_num[prev_pos1];
             }
         }
-        class_num = new_class_num;
+        class_num.swap(new_class_num);
     }
-
-    return result;
 }
 
+template <typename size_type>
+template <typename text_type>
+void SaisSuffixArrayBuilder<size_type>::induce(const text_type &text, Level &level, vector<size_type> &result,
+                                               const vector<size_type> &lmsPositions) {
+    size_type length = text.size();
+    const vector<bool> &isSType = level.isSType;
+    vector<size_type> &bucket = level.bucket;
+    fill(begin(result), end(result), -1);
 
-void HaffmanCoder::makeFrequencyVocabulary() {
-    frequencyVocabulary.resize(ALPHABET_SIZE);
-    for (int i = 0; i < text.size(); ++i) {
-        int index = symbolToIndex[text[i]];
-        ++frequencyVocabulary[index];
+    bucket = level.bucketStartS;
+    for (size_t i = 0; i < lmsPositions.size(); ++i) {
+        size_type position = lmsPositions[i];
+        result[bucket[text[position]]++] = position;
     }
-}
 
-void HaffmanCoder::makeCodeTree() {
-    priority_queue<Node> symbolCounts;
+    bucket = level.bucketStartL;
+    result[bucket[text[length - 1]]++] = length - 1;
+    for (size_type i = 0; i < length; ++i) {
+        size_type position = result[i];
+        if (position >= 1 && !isSType[position - 1]) {
+            result[bucket[text[position - 1]]++] = position - 1;
+        }
+    }
 
-    for (int i = 0; i < ALPHABET_SIZE; ++i) {
-        if (frequencyVocabulary[i] != 0) {
-            symbolCounts.push(Node(ALLOWED_SYMBOLS[i], frequencyVocabulary[i]));
+    bucket = level.bucketStartL;
+    for (size_type i = length - 1; i != -1; --i) {
+        size_type position = result[i];
+        if (position >= 1 && isSType[position - 1]) {
+            result[--bucket[text[position - 1] + 1]] = position - 1;
         }
     }
+}
 
-    while (symbolCounts.size() > 1) {
-        Node firstNode = symbolCounts.top();
-        symbolCounts.pop();
-        Node secondNode = symbolCounts.top();
-        symbolCounts.pop();
+template <typename size_type>
+template <typename text_type>
+void SaisSuffixArrayBuilder<size_type>::buildSuffixArray(const text_type &text, size_type upper, size_t depth,
+                                                         vector<size_type> &result) {
+    if (depth + 1 >= levels.size()) {
+        levels.resize(depth + 2);
+    }
+    Level &level = levels[depth];
 
-        Node parentNode('#', firstNode.count + secondNode.count);
-        parentNode.leftSon = new Node(firstNode);
-        parentNode.rightSon = new Node(secondNode);
+    size_type length = text.size();
+    if (length <= 1) {
+        result.assign(length, 0);
+        return;
+    }
 
-        symbolCounts.push(parentNode);
+    resizeExactly(result, length);
+    vector<bool> &isSType = level.isSType;
+    resizeExactly(isSType, length);
+    isSType[length - 1] = false;
+    for (size_type i = length - 2; i != -1; --i) {
+        isSType[i] = (text[i] == text[i + 1]) ? isSType[i + 1] : (text[i] < text[i + 1]);
     }
-    codeTreeRoot = new Node(symbolCounts.top());
-    symbolCounts.pop();
-}
 
-void HaffmanCoder::makeDisplaySymbolToCode(Node *currentNode, const string prefix) {
-    if (currentNode->leftSon != NULL) {
-        makeDisplaySymbolToCode(currentNode->leftSon, prefix + "0");
+    vector<size_type> &bucketStartL = level.bucketStartL, &bucketStartS = level.bucketStartS;
+    bucketStartL.assign(upper + 2, 0);
+    bucketStartS.assign(upper + 2, 0);
+    for (size_type i = 0; i < length; ++i) {
+        if (!isSType[i]) {
+            ++bucketStartS[text[i]];
+        }
+        else {
+            ++bucketStartL[text[i] + 1];
+        }
     }
-    if (currentNode->rightSon != NULL) {
-        makeDisplaySymbolToCode(currentNode->rightSon, prefix + "1");
+    for (size_type c = 0; c <= upper; ++c) {
+        bucketStartS[c] += bucketStartL[c];
+        bucketStartL[c + 1] += bucketStartS[c];
     }
 
-    if (currentNode->leftSon == NULL && currentNode->rightSon == NULL) {
-        char symbol = currentNode->symbol;
-        string codeNode = prefix;
-        displaySymbolToCode.insert(make_pair(symbol, codeNode));
+    // the arrays get their exact sizes, so they never hold more than the LMS positions
+    size_type lmsCount = 0;
+    for (size_type i = 1; i < length; ++i) {
+        lmsCount += isLms(isSType, i);
+    }
+    vector<size_type> &lmsPositions = level.lmsPositions;
+    resizeExactly(lmsPositions, lmsCount);
+    for (size_type i = 1, next = 0; i < length; ++i) {
+        if (isLms(isSType, i)) {
+            lmsPositions[next++] = i;
+        }
     }
-}
 
-void HaffmanCoder::codeText() {
-    char symbol;
-    string currentBits;
-
-    for (int i = 0; i < text.size(); ++i) {
-        currentBits.append(displaySymbolToCode[text[i]]);
-        while (currentBits.size() >= 8) {
-            totalCountBits += 8;
-            symbol = 0;
-            for (int bit = 0; bit < 8; ++bit) {
-                if (currentBits[bit] == '1') {
-                    symbol += 1 << bit;
-                }
-            }
-            currentBits.erase(0, 8);
-            codedText.push_back(symbol);
+    induce(text, level, result, lmsPositions);
+    if (lmsCount == 0) {
+        return;
+    }
 
+    vector<size_type> &sortedLms = level.sortedLms;
+    resizeExactly(sortedLms, lmsCount);
+    for (size_type i = 0, next = 0; i < length; ++i) {
+        if (result[i] > 0 && isLms(isSType, result[i])) {
+            sortedLms[next++] = result[i];
         }
     }
 
-    if (currentBits.size() > 0) {
-        totalCountBits += currentBits.size();
-        symbol = 0;
-        for (int bit = 0; bit < currentBits.size(); ++bit) {
-            if (currentBits[bit] == '1') {
-                symbol += 1 << bit;
+    // name LMS substrings in their induced order and sort them recursively if the names collide;
+    // the last symbol is never LMS and LMS positions are at least two apart, so the name of
+    // position p goes to result[p / 2]
+    fill(begin(result), end(result), -1);
+    size_type reducedUpper = 0;
+    result[sortedLms[0] / 2] = 0;
+    for (size_type i = 1; i < lmsCount; ++i) {
+        size_type left = sortedLms[i - 1], right = sortedLms[i];
+        size_type leftEnd = lmsEnd(isSType, left), rightEnd = lmsEnd(isSType, right);
+
+        bool same = (leftEnd - left == rightEnd - right);
+        if (same) {
+            while (left < leftEnd && text[left] == text[right]) {
+                ++left;
+                ++right;
             }
+            same = left != length && right != length && text[left] == text[right];
+        }
+        if (!same) {
+            ++reducedUpper;
+        }
+        result[sortedLms[i] / 2] = reducedUpper;
+    }
+    vector<size_type> &reducedText = level.reducedText;
+    resizeExactly(reducedText, lmsCount);
+    for (size_type i = 0, next = 0; i < length / 2; ++i) {
+        if (result[i] != -1) {
+            reducedText[next++] = result[i];
         }
-        codedText.push_back(symbol);
-        currentBits.clear();
     }
+
+    vector<size_type> &reducedResult = levels[depth + 1].result;
+    buildSuffixArray(reducedText, reducedUpper, depth + 1, reducedResult);
+    for (size_type i = 0; i < lmsCount; ++i) {
+        sortedLms[i] = lmsPositions[reducedResult[i]];
+    }
+    induce(text, level, result, sortedLms);
 }
 
-void HaffmanCoder::outputCodedData(ostream &outputStream) {
-    outputStream << displaySymbolToCode.size() << '\n';
-    for (int i = 0; i < ALPHABET_SIZE; ++i) {
-        if (frequencyVocabulary[i] != 0) {
-            char symbol = ALLOWED_SYMBOLS[i];
-            outputStream << displaySymbolToCode[symbol] << ' ' << symbol << '\n';
+// Start of the least rotation: two candidates are compared, and the one found bigger after
+// k equal symbols skips them, as none of its next k rotations can be the least either.
+size_t leastRotation(const string &text) {
+    const size_t SIZE = text.size();
+    size_t first = 0, second = 1, matched = 0;
+    while (first < SIZE && second < SIZE && matched < SIZE) {
+        size_t left = first + matched, right = second + matched;
+        unsigned char leftSymbol = text[left < SIZE ? left : left - SIZE];
+        unsigned char rightSymbol = text[right < SIZE ? right : right - SIZE];
+        if (leftSymbol == rightSymbol) {
+            ++matched;
+            continue;
+        }
+        if (leftSymbol > rightSymbol) {
+            first += matched + 1;
+        }
+        else {
+            second += matched + 1;
         }
+        if (first == second) {
+            ++second;
+        }
+        matched = 0;
     }
-    outputStream << totalCountBits << '\n';
+    return std::min(first, second);
+}
+
+// The rotations of the least rotation w of the block are ordered like its suffixes: where
+// a suffix is a prefix of a longer one, the rotation of the shorter goes on with w itself,
+// which is no bigger than any rotation. So SA-IS over w with its usual sentinel sorts the
+// rotations of the block without doubling it, equal rotations end up in some order.
+template <typename size_type>
+void SaisSuffixArrayBuilder<size_type>::build(const string& initialString, vector<size_type> &result) {
+    size_type length = initialString.size();
+    size_type shift = leastRotation(initialString);
+    resizeExactly(rotatedText, length);
+    copy(initialString.begin() + shift, initialString.end(), rotatedText.begin());
+    copy(initialString.begin(), initialString.begin() + shift, rotatedText.begin() + (length - shift));
 
-    for (int i = 0; i < codedText.size(); ++i) {
-        outputStream.put(codedText[i]);
+    buildSuffixArray(rotatedText, ALPHABET_SIZE - 1, 0, result);
+    for (size_type i = 0; i < length; ++i) {
+        result[i] = result[i] < length - shift ? result[i] + shift : result[i] - (length - shift);
     }
 }
 
-class Compressor {
-private:
-    BarrowsWillerTransformator BWT;
-    MoveToFrontTransformator MTFT;
-    HaffmanCoder haffmanCoder;
 
-private:
-    void actuallyCompression(const string &initialString) {
-        string transformedByBWTString = BWT.transform(initialString);
-        string transformedByMTFString = MTFT.transform(transformedByBWTString);
-        haffmanCoder.code(transformedByMTFString);
-    }
-    void outputData(ostream &outputStream) {
-        outputStream << BWT.getInitialStringIndex() << '\n';
-        haffmanCoder.outputCodedData(outputStream);
+void HaffmanCoder::makeFrequencyVocabulary() {
+    frequencyVocabulary.assign(alphabetSize, 0);
+    for (size_t i = 0; i < text->size(); ++i) {
+        ++frequencyVocabulary[(*text)[i]];
     }
+}
 
-public:
-    void compress(string inputFile, string outputFile);
+// Moffat-Katajainen: the Haffman tree is built inside the array of sorted weights, which
+// first holds parent links, then depths of internal nodes and at last the code lengths.
+void HaffmanCoder::makeCodeLengths() {
+    sortedSymbols.clear();
+    for (int i = 0; i < alphabetSize; ++i) {
+        if (frequencyVocabulary[i] != 0) {
+            sortedSymbols.push_back(i);
+        }
+    }
+    const vector<int> &frequencies = frequencyVocabulary;
+    sort(sortedSymbols.begin(), sortedSymbols.end(), [&frequencies](int left, int right) {
+        return frequencies[left] < frequencies[right] || (frequencies[left] == frequencies[right] && left < right);
+    });
 
-};
+    const int n = sortedSymbols.size();
+    codeLengths.assign(alphabetSize, 0);
+    if (n <= 1) {
+        // a block of one repeated symbol still needs a non-empty code
+        if (n == 1) {
+            codeLengths[sortedSymbols[0]] = 1;
+        }
+        return;
+    }
 
+    weights.resize(n);
+    for (int i = 0; i < n; ++i) {
+        weights[i] = frequencyVocabulary[sortedSymbols[i]];
+    }
+    long long *A = weights.data();
 
-string BarrowsWillerTransformator::transform(const string &initialString) {
-    FastSuffixArrayBuilder<int> suffarrayBuilder;
-    vector<int> suffarray = suffarrayBuilder.build(initialString);
-    string transformedString;
-    const int SIZE = suffarray.size();
+    // left to right: internal node next takes the two lightest of leaves and earlier nodes
+    A[0] += A[1];
+    int root = 0, leaf = 2;
+    for (int next = 1; next < n - 1; ++next) {
+        if (leaf >= n || A[root] < A[leaf]) {
+            A[next] = A[root];
+            A[root++] = next;
+        }
+        else {
+            A[next] = A[leaf++];
+        }
+        if (leaf >= n || (root < next && A[root] < A[leaf])) {
+            A[next] += A[root];
+            A[root++] = next;
+        }
+        else {
+            A[next] += A[leaf++];
+        }
+    }
 
-    char symbol[2] = { ' ', '\0' };
-    for (int i = 0; i < SIZE; ++i) {
-        int index = (suffarray[i] + SIZE - 1) % SIZE;
-        symbol[0] = initialString[index];
-        transformedString.append(symbol);
+    // right to left: depths of internal nodes from the parent links
+    A[n - 2] = 0;
+    for (int next = n - 3; next >= 0; --next) {
+        A[next] = A[A[next]] + 1;
+    }
 
-        if (suffarray[i] == 0) {
-            initialStringIndex = i;
+    // right to left: every level hands out its free slots to leaves
+    int available = 1, used = 0, depth = 0, next = n - 1;
+    root = n - 2;
+    while (available > 0) {
+        while (root >= 0 && A[root] == depth) {
+            ++used;
+            --root;
         }
+        while (available > used) {
+            A[next--] = depth;
+            --available;
+        }
+        available = 2 * used;
+        ++depth;
+        used = 0;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        codeLengths[sortedSymbols[i]] = A[i];
+    }
+    if (A[0] > HAFFMAN_MAX_CODE_LENGTH) {
+        limitCodeLengths();
     }
-    return transformedString;
 }
 
-string MoveToFrontTransformator::transform(const string &initialString) {
-    deque<char> encode;
-    for (int i = 0; i < ALPHABET_SIZE; ++i) {
-        encode.push_back(ALLOWED_SYMBOLS[i]);
-    }
-    vector<int> transformedSequence(initialString.size());
-
-    for (int i = 0; i < initialString.size(); ++i) {
-        char symbol = initialString[i];
-        for (int index = 0;; ++index) {
-            if (encode[index] == symbol) {
-                transformedSequence[i] = index;
-                encode.erase(encode.begin() + index);
-                encode.push_front(symbol);
-                break;
+// Package-merge: the optimal code with lengths up to the limit. The list of a level merges the
+// sorted leaves with pairs ("packages") of the list one level deeper; the first 2n - 2 items of
+// the top list choose the code, a leaf gets one bit for every level where it is chosen.
+void HaffmanCoder::limitCodeLengths() {
+    const int n = sortedSymbols.size();
+    const int LIST_SIZE = 2 * n;
+    packageWeights.resize(HAFFMAN_MAX_CODE_LENGTH * LIST_SIZE);
+    packageIsLeaf.resize(HAFFMAN_MAX_CODE_LENGTH * LIST_SIZE);
+    int listSizes[HAFFMAN_MAX_CODE_LENGTH];
+
+    // the deepest level holds the leaves alone
+    for (int i = 0; i < n; ++i) {
+        packageWeights[i] = frequencyVocabulary[sortedSymbols[i]];
+        packageIsLeaf[i] = 1;
+    }
+    listSizes[0] = n;
+    for (int level = 1; level < HAFFMAN_MAX_CODE_LENGTH; ++level) {
+        const long long *deeper = &packageWeights[(level - 1) * LIST_SIZE];
+        long long *list = &packageWeights[level * LIST_SIZE];
+        char *isLeaf = &packageIsLeaf[level * LIST_SIZE];
+        int packages = listSizes[level - 1] / 2, leaf = 0, package = 0, size = 0;
+        while (leaf < n || package < packages) {
+            long long packageWeight = package < packages ? deeper[2 * package] + deeper[2 * package + 1] : 0;
+            if (package == packages || (leaf < n && frequencyVocabulary[sortedSymbols[leaf]] <= packageWeight)) {
+                list[size] = frequencyVocabulary[sortedSymbols[leaf++]];
+                isLeaf[size++] = 1;
+            }
+            else {
+                list[size] = packageWeight;
+                isLeaf[size++] = 0;
+                ++package;
             }
         }
+        listSizes[level] = size;
     }
 
-    string transformedString;
-    char symbol[2] = { ' ', '\0' };
-    for (int i = 0; i < transformedSequence.size(); ++i) {
-        symbol[0] = ALLOWED_SYMBOLS[transformedSequence[i]];
-        transformedString.append(symbol);
+    for (int i = 0; i < n; ++i) {
+        codeLengths[sortedSymbols[i]] = 0;
+    }
+    int chosen = 2 * n - 2;
+    for (int level = HAFFMAN_MAX_CODE_LENGTH - 1; level >= 0 && chosen > 0; --level) {
+        const char *isLeaf = &packageIsLeaf[level * LIST_SIZE];
+        int leaves = 0;
+        for (int i = 0; i < chosen; ++i) {
+            leaves += isLeaf[i];
+        }
+        // leaves enter every list in the same order, so the chosen ones are the lightest
+        for (int i = 0; i < leaves; ++i) {
+            ++codeLengths[sortedSymbols[i]];
+        }
+        chosen = 2 * (chosen - leaves);
     }
-
-    return transformedString;
 }
 
-void initialize() {
-    for (int index = 0; index < ALPHABET_SIZE; ++index) {
-        char symbol = ALLOWED_SYMBOLS[index];
-        symbolToIndex.insert(make_pair(symbol, index));
+// Canonical codes: symbols ordered by (length, index) get consecutive codes,
+// so the decompressor rebuilds them from the code lengths alone.
+void HaffmanCoder::makeDisplaySymbolToCode() {
+    uint32_t lengthCount[HAFFMAN_MAX_CODE_LENGTH + 1] = { 0 };
+    for (int i = 0; i < alphabetSize; ++i) {
+        ++lengthCount[codeLengths[i]];
+    }
+    lengthCount[0] = 0;
+    uint32_t nextCode[HAFFMAN_MAX_CODE_LENGTH + 1] = { 0 };
+    for (int length = 1; length <= HAFFMAN_MAX_CODE_LENGTH; ++length) {
+        nextCode[length] = (nextCode[length - 1] + lengthCount[length - 1]) << 1;
+    }
+
+    displaySymbolToCode.assign(alphabetSize, 0);
+    for (int i = 0; i < alphabetSize; ++i) {
+        int length = codeLengths[i];
+        if (length == 0) {
+            continue;
+        }
+        uint32_t code = nextCode[length]++;
+        uint64_t reversedCode = 0;
+        for (int bit = 0; bit < length; ++bit) {
+            reversedCode |= (uint64_t)((code >> (length - 1 - bit)) & 1) << bit;
+        }
+        displaySymbolToCode[i] = reversedCode;
     }
 }
 
-string readData(istream& inputStream) {
-    string data;
-    char symbol[2] = { ' ', '\0' };
+void HaffmanCoder::codeText() {
+    totalCountBits = 0;
+    for (int i = 0; i < alphabetSize; ++i) {
+        totalCountBits += (uint64_t)frequencyVocabulary[i] * codeLengths[i];
+    }
+    codedText.reset(totalCountBits);
 
-    while (!inputStream.eof()) {
-        inputStream.read(symbol, C_SIZE);
-        if (symbol[0] == '\r' || symbol[0] == '\n') {
-            break;
-        }
-        data.append(symbol);
+    for (size_t i = 0; i < text->size(); ++i) {
+        int index = (*text)[i];
+        codedText.writeBits(displaySymbolToCode[index], codeLengths[index]);
+    }
+    codedText.flush();
+}
+
+// Header: count of symbols up to the last one used, a length byte per symbol, count of bits.
+void HaffmanCoder::outputCodedData(ostream &outputStream) {
+    int symbolCount = alphabetSize;
+    while (symbolCount > 0 && codeLengths[symbolCount - 1] == 0) {
+        --symbolCount;
+    }
+    writeUint(outputStream, symbolCount, 2);
+    for (int symbol = 0; symbol < symbolCount; ++symbol) {
+        outputStream.put((char)codeLengths[symbol]);
     }
-    return data;
+    writeUint(outputStream, totalCountBits, 4);
+
+    outputStream.write(codedText.data(), codedText.size());
 }
 
-void Compressor::compress(string inputFile, string outputFile) {
-    ifstream aliceStream(inputFile, std::ios::binary | std::ios::in);
-    ofstream compressedOutputStream(outputFile, std::ios::binary | std::ios::out);
+uint64_t HaffmanCoder::codedSize() {
+    int symbolCount = alphabetSize;
+    while (symbolCount > 0 && codeLengths[symbolCount - 1] == 0) {
+        --symbolCount;
+    }
+    return 2 + symbolCount + 4 + codedText.size();
+}
 
-    string aliceString = readData(aliceStream);
+int highestBit(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
 
-    actuallyCompression(aliceString);
-    outputData(compressedOutputStream);
+void AnsCoder::makeFrequencyVocabulary() {
+    frequencyVocabulary.assign(alphabetSize, 0);
+    for (size_t i = 0; i < text->size(); ++i) {
+        ++frequencyVocabulary[(*text)[i]];
+    }
 }
 
+// Scales counts to sum up to the table size, every present symbol keeps at least one state.
+void AnsCoder::normalizeCounts() {
+    const int TABLE_SIZE = 1 << ANS_TABLE_LOG;
+    normalizedCounts.assign(alphabetSize, 0);
 
-int main() {
-    initialize();
-    Compressor compressor;
-    compressor.compress("input.txt", "compressed.txt");
+    int total = 0;
+    for (int i = 0; i < alphabetSize; ++i) {
+        if (frequencyVocabulary[i] != 0) {
+            normalizedCounts[i] = std::max(1, (int)((uint64_t)frequencyVocabulary[i] * TABLE_SIZE / text->size()));
+            total += normalizedCounts[i];
+        }
+    }
+    // rounding errors go to the symbols with the most states, they lose the least precision
+    while (total != TABLE_SIZE) {
+        int largest = max_element(normalizedCounts.begin(), normalizedCounts.end()) - normalizedCounts.begin();
+        if (total < TABLE_SIZE) {
+            normalizedCounts[largest] += TABLE_SIZE - total;
+            total = TABLE_SIZE;
+        }
+        else {
+            int excess = std::min(total - TABLE_SIZE, (normalizedCounts[largest] + 1) / 2);
+            normalizedCounts[largest] -= excess;
+            total -= excess;
+        }
+    }
+}
+
+// Spreads symbols over the states with the FSE step and lists the states of every symbol.
+void AnsCoder::makeStateTable() {
+    const int TABLE_SIZE = 1 << ANS_TABLE_LOG;
+    const int STEP = (TABLE_SIZE >> 1) + (TABLE_SIZE >> 3) + 3;
+
+    stateSymbol.resize(TABLE_SIZE);
+    int position = 0;
+    for (int symbol = 0; symbol < alphabetSize; ++symbol) {
+        for (int i = 0; i < normalizedCounts[symbol]; ++i) {
+            stateSymbol[position] = symbol;
+            position = (position + STEP) & (TABLE_SIZE - 1);
+        }
+    }
+
+    stateStart.assign(alphabetSize + 1, 0);
+    for (int symbol = 0; symbol < alphabetSize; ++symbol) {
+        stateStart[symbol + 1] = stateStart[symbol] + normalizedCounts[symbol];
+    }
+    nextState.assign(stateStart.begin(), stateStart.end() - 1);
+    symbolStates.resize(TABLE_SIZE);
+    for (int state = 0; state < TABLE_SIZE; ++state) {
+        symbolStates[nextState[stateSymbol[state]]++] = state;
+    }
+}
+
+// Symbols are coded from the last one, so the decoder meets them in the direct order.
+// The low bits shifted out of the state are kept per symbol and written in the direct order too.
+void AnsCoder::codeText() {
+    const int TABLE_SIZE = 1 << ANS_TABLE_LOG;
+    size_t length = text->size();
+    chunkBits.resize(length);
+    chunkLengths.resize(length);
+
+    totalCountBits = ANS_TABLE_LOG;
+    uint32_t state = TABLE_SIZE;
+    for (size_t i = length; i-- > 0;) {
+        int symbol = (*text)[i];
+        int count = normalizedCounts[symbol];
+        // state >> bits has to land in [count, 2 * count)
+        int bits = ANS_TABLE_LOG - highestBit(count);
+        if ((int)(state >> bits) < count) {
+            --bits;
+        }
+        chunkBits[i] = state & ((1u << bits) - 1);
+        chunkLengths[i] = bits;
+        totalCountBits += bits;
+        state = TABLE_SIZE + symbolStates[stateStart[symbol] + (state >> bits) - count];
+    }
+    finalState = state - TABLE_SIZE;
+
+    codedText.reset(totalCountBits);
+    codedText.writeBits(finalState, ANS_TABLE_LOG);
+    for (size_t i = 0; i < length; ++i) {
+        codedText.writeBits(chunkBits[i], chunkLengths[i]);
+    }
+    codedText.flush();
+}
+
+// Normalized counts take one byte below 128 and two bytes otherwise.
+void writeSmallNumber(ostream &outputStream, int value) {
+    if (value < 0x80) {
+        outputStream.put((char)value);
+    }
+    else {
+        outputStream.put((char)(0x80 | (value >> 8)));
+        outputStream.put((char)value);
+    }
+}
+
+// Header: table log, count of symbols up to the last one used, their normalized counts,
+// count of coded symbols and count of bits.
+void AnsCoder::outputCodedData(ostream &outputStream) {
+    int symbolCount = alphabetSize;
+    while (symbolCount > 0 && normalizedCounts[symbolCount - 1] == 0) {
+        --symbolCount;
+    }
+    outputStream.put((char)ANS_TABLE_LOG);
+    writeUint(outputStream, symbolCount, 2);
+    for (int i = 0; i < symbolCount; ++i) {
+        writeSmallNumber(outputStream, normalizedCounts[i]);
+    }
+    writeUint(outputStream, text->size(), 4);
+    writeUint(outputStream, totalCountBits, 4);
+
+    outputStream.write(codedText.data(), codedText.size());
+}
+
+uint64_t AnsCoder::codedSize() {
+    int symbolCount = alphabetSize;
+    while (symbolCount > 0 && normalizedCounts[symbolCount - 1] == 0) {
+        --symbolCount;
+    }
+    uint64_t size = 1 + 2 + 4 + 4 + codedText.size();
+    for (int i = 0; i < symbolCount; ++i) {
+        size += normalizedCounts[i] < 0x80 ? 1 : 2;
+    }
+    return size;
+}
+
+struct CompressedFrame {
+    string data;
+    int blockLength;
+    BlockStats stats;
+    // FM-index record of the block, empty unless asked for
+    string fmIndex;
+};
+
+struct FrameIndexEntry {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t blockLength;
+};
+
+// Frame index and trailer, the frames and whatever follows them end at indexOffset.
+void writeArchiveIndex(ostream &outputStream, const vector<FrameIndexEntry> &frameIndex, uint64_t indexOffset,
+                       const string &magic = ARCHIVE_MAGIC) {
+    for (size_t i = 0; i < frameIndex.size(); ++i) {
+        writeUint(outputStream, frameIndex[i].offset, 8);
+        writeUint(outputStream, frameIndex[i].size, 8);
+        writeUint(outputStream, frameIndex[i].blockLength, 8);
+    }
+    writeUint(outputStream, frameIndex.size(), 8);
+    writeUint(outputStream, indexOffset, 8);
+    outputStream << magic;
+}
+
+// An archive that new frames are appended to, and its FM index if that grows too. The new
+// frames overwrite the old index and trailer and the new index follows them, so the file
+// grows by the new frames and their index entries only. The old index and trailer are kept
+// here, a failed append cuts the file back to its frames and writes them again.
+struct ExistingArchive {
+    vector<FrameIndexEntry> frameIndex;
+    uint64_t framesEnd;
+    string indexBytes;
+    vector<uint64_t> fmIndexOffsets;
+    uint64_t fmIndexRecordsEnd;
+    string fmIndexBytes;
+
+    ExistingArchive() : framesEnd(0), fmIndexRecordsEnd(0) {
+    }
+};
+
+// Reads the trailer of an archive or FM index, returns the count of entries and where they start.
+pair<uint64_t, uint64_t> readTrailer(istream &inputStream, const string &magic, int entrySize) {
+    inputStream.seekg(0, std::ios::end);
+    uint64_t fileSize = inputStream.tellg();
+    const uint64_t TRAILER_SIZE = 16 + magic.size();
+    if (!inputStream || fileSize < TRAILER_SIZE) {
+        return make_pair(0, UINT64_MAX);
+    }
+    inputStream.seekg(fileSize - TRAILER_SIZE);
+    uint64_t count = readUint(inputStream, 8);
+    uint64_t indexOffset = readUint(inputStream, 8);
+    string foundMagic(magic.size(), ' ');
+    inputStream.read(&foundMagic[0], foundMagic.size());
+    if (!inputStream || foundMagic != magic || count > fileSize / entrySize
+        || indexOffset + count * entrySize + TRAILER_SIZE != fileSize) {
+        return make_pair(0, UINT64_MAX);
+    }
+    inputStream.seekg(indexOffset);
+    return make_pair(count, indexOffset);
+}
+
+// The index and trailer from the given offset to the end of the file.
+string readIndexBytes(istream &inputStream, uint64_t offset) {
+    inputStream.clear();
+    inputStream.seekg(0, std::ios::end);
+    string bytes((uint64_t)inputStream.tellg() - offset, '\0');
+    inputStream.seekg(offset);
+    inputStream.read(&bytes[0], bytes.size());
+    if (!inputStream) {
+        throw runtime_error("cannot read the index to append to");
+    }
+    return bytes;
+}
+
+// Only archives whose index directly follows their frames can grow, the record table of
+// a batch would end up among the frames. An archive written with an FM index grows only
+// together with it, its sidecar would no longer match otherwise.
+ExistingArchive readExistingArchive(const string &path, const string &fmIndexPath) {
+    ExistingArchive archive;
+    ifstream archiveStream(path.c_str(), std::ios::binary);
+    pair<uint64_t, uint64_t> trailer = readTrailer(archiveStream, ARCHIVE_MAGIC, 24);
+    bool fmIndexed = false;
+    if (trailer.second == UINT64_MAX) {
+        archiveStream.clear();
+        trailer = readTrailer(archiveStream, FM_INDEXED_ARCHIVE_MAGIC, 24);
+        fmIndexed = true;
+    }
+    if (trailer.second == UINT64_MAX) {
+        throw runtime_error(path + " is not an archive to append to");
+    }
+    if (fmIndexed && fmIndexPath.empty()) {
+        throw runtime_error(path + " has an FM index, append to it with --fm-index");
+    }
+    archive.frameIndex.resize(trailer.first);
+    uint64_t framesEnd = 0;
+    for (size_t i = 0; i < archive.frameIndex.size(); ++i) {
+        archive.frameIndex[i].offset = readUint(archiveStream, 8);
+        archive.frameIndex[i].size = readUint(archiveStream, 8);
+        archive.frameIndex[i].blockLength = readUint(archiveStream, 8);
+        framesEnd = std::max(framesEnd, archive.frameIndex[i].offset + archive.frameIndex[i].size);
+    }
+    if (framesEnd != trailer.second) {
+        throw runtime_error(path + " holds more than frames, only plain archives can grow");
+    }
+    archive.framesEnd = framesEnd;
+    archive.indexBytes = readIndexBytes(archiveStream, framesEnd);
+
+    if (!fmIndexPath.empty()) {
+        ifstream fmIndexStream(fmIndexPath.c_str(), std::ios::binary);
+        pair<uint64_t, uint64_t> fmIndexTrailer = readTrailer(fmIndexStream, FM_INDEX_MAGIC, 8);
+        if (!fmIndexed || fmIndexTrailer.second == UINT64_MAX || fmIndexTrailer.first != archive.frameIndex.size()) {
+            throw runtime_error(fmIndexPath + " is not the FM index of " + path);
+        }
+        archive.fmIndexOffsets.resize(fmIndexTrailer.first);
+        for (size_t i = 0; i < archive.fmIndexOffsets.size(); ++i) {
+            archive.fmIndexOffsets[i] = readUint(fmIndexStream, 8);
+        }
+        archive.fmIndexRecordsEnd = fmIndexTrailer.second;
+        archive.fmIndexBytes = readIndexBytes(fmIndexStream, fmIndexTrailer.second);
+    }
+    return archive;
+}
+
+// One BWT -> MTF -> Haffman chain, every worker thread owns its own.
+class BlockCompressor {
+private:
+    BarrowsWillerTransformator BWT;
+    MoveToFrontTransformator MTFT;
+    ZeroRunLengthCoder zeroRunLengthCoder;
+    HaffmanCoder haffmanCoder;
+    AnsCoder ansCoder;
+    IEntropyCoder *entropyCoder;
+    int entropyCoderId;
+    Crc32c crc32c;
+    uint32_t blockChecksum;
+    FmIndexBuilder fmIndexBuilder;
+    string fmIndexRecord;
+
+    bool zeroRuns;
+    bool fmIndex;
+    string entropyCoderName;
+    // outputs of the stages, kept between blocks with the work arrays of the stages themselves
+    string transformedByBWTString;
+    string transformedByMTFString;
+    vector<uint16_t> codedSymbols;
+    long long stagePeaks[STAGE_COUNT];
+    BlockStats stats;
+    chrono::steady_clock::time_point stageStart;
+
+private:
+    void startStage() {
+        peakHeapBytes = liveHeapBytes.load();
+        stageStart = chrono::steady_clock::now();
+    }
+    // the heap peak is exact with one thread, with several it is the peak of the whole process
+    void finishStage(CompressionStage stage, uint64_t bytesIn, uint64_t bytesOut) {
+        StageStats &stageStats = stats.stages[stage];
+        stageStats.seconds = chrono::duration<double>(chrono::steady_clock::now() - stageStart).count();
+        stageStats.bytesIn = bytesIn;
+        stageStats.bytesOut = bytesOut;
+        stageStats.peakHeapBytes = peakHeapBytes.load();
+        stagePeaks[stage] = std::max(stagePeaks[stage], stageStats.peakHeapBytes);
+    }
+    // "auto" codes the block with both coders and keeps the smaller frame
+    void codeSymbols(int alphabetSize) {
+        if (entropyCoderName != "ans") {
+            haffmanCoder.code(codedSymbols, alphabetSize);
+            entropyCoder = &haffmanCoder;
+            entropyCoderId = ENTROPY_HAFFMAN;
+        }
+        if (entropyCoderName != "haffman") {
+            ansCoder.code(codedSymbols, alphabetSize);
+            if (entropyCoderName == "ans" || ansCoder.codedSize() < haffmanCoder.codedSize()) {
+                entropyCoder = &ansCoder;
+                entropyCoderId = ENTROPY_ANS;
+            }
+        }
+    }
+    void actuallyCompression(const string &initialString) {
+        const uint64_t SIZE = initialString.size();
+        startStage();
+        BWT.transform(initialString, transformedByBWTString);
+        if (fmIndex) {
+            fmIndexRecord = fmIndexBuilder.build(initialString, transformedByBWTString, BWT.getSuffarray(),
+                                                 BWT.getInitialStringIndex(), blockChecksum);
+        }
+        finishStage(STAGE_BWT, SIZE, SIZE);
+
+        startStage();
+        MTFT.transform(transformedByBWTString, transformedByMTFString);
+        finishStage(STAGE_MTF, SIZE, SIZE);
+
+        startStage();
+        if (zeroRuns) {
+            zeroRunLengthCoder.transform(transformedByMTFString, codedSymbols);
+        }
+        else {
+            codedSymbols.resize(transformedByMTFString.size());
+            for (size_t i = 0; i < codedSymbols.size(); ++i) {
+                codedSymbols[i] = (unsigned char)transformedByMTFString[i];
+            }
+        }
+        const uint64_t SYMBOLS_SIZE = codedSymbols.size() * sizeof(uint16_t);
+        finishStage(STAGE_ZERO_RUNS, SIZE, SYMBOLS_SIZE);
+
+        startStage();
+        codeSymbols(zeroRuns ? ZERO_RUN_ALPHABET_SIZE : ALPHABET_SIZE);
+        finishStage(STAGE_ENTROPY, SYMBOLS_SIZE, entropyCoder->codedSize());
+
+        stats.primaryIndex = BWT.getInitialStringIndex();
+        stats.distinctSymbols = entropyCoder->distinctSymbols();
+        stats.averageCodeLength = codedSymbols.empty() ? 0.0 : (double)entropyCoder->codedBits() / codedSymbols.size();
+        stats.entropyCoderId = entropyCoderId;
+    }
+    void outputData(ostream &outputStream, int blockLength) {
+        writeUint(outputStream, blockLength, 4);
+        writeUint(outputStream, blockChecksum, 4);
+        writeUint(outputStream, BWT.getInitialStringIndex(), 4);
+        const vector<int> &walkStarts = BWT.getWalkStarts();
+        outputStream.put((char)walkStarts.size());
+        for (size_t i = 1; i < walkStarts.size(); ++i) {
+            writeUint(outputStream, walkStarts[i], 4);
+        }
+        outputStream.put(zeroRuns ? FRAME_FLAG_ZERO_RUNS : 0);
+        outputStream.put((char)entropyCoderId);
+        entropyCoder->outputCodedData(outputStream);
+    }
+
+public:
+    BlockCompressor() : zeroRuns(true), fmIndex(false), entropyCoderName("auto") {
+        fill(stagePeaks, stagePeaks + STAGE_COUNT, 0);
+    }
+    void setEntropyCoder(const string &name) {
+        entropyCoderName = name;
+    }
+    void setSuffarrayBuilder(const string &name) {
+        BWT.setSuffarrayBuilder(name);
+    }
+    void setZeroRuns(bool enabled) {
+        zeroRuns = enabled;
+    }
+    void setFmIndex(bool enabled) {
+        fmIndex = enabled;
+    }
+    // Replaces the frame with the one of the block, its data keeps the capacity it had.
+    void compressBlock(const string &block, CompressedFrame &frame) {
+        blockChecksum = crc32c.compute(block.data(), block.size());
+        actuallyCompression(block);
+        startStage();
+        frame.data.clear();
+        StringOutputBuffer frameBuffer(frame.data);
+        ostream frameStream(&frameBuffer);
+        outputData(frameStream, block.size());
+
+        frame.blockLength = block.size();
+        finishStage(STAGE_FRAME, entropyCoder->codedSize(), frame.data.size());
+        frame.stats = stats;
+        frame.fmIndex.swap(fmIndexRecord);
+    }
+    const long long *getStagePeaks() const {
+        return stagePeaks;
+    }
+    void resetStagePeaks() {
+        fill(stagePeaks, stagePeaks + STAGE_COUNT, 0);
+    }
+};
+
+// Working memory of the compressor kept between calls: the suffix array, the outputs of the
+// transforms and the coder tables of every chain grow to the biggest block seen and then
+// stay, so a caller compressing many inputs one after another stops allocating them.
+// A context serves one call at a time, concurrent callers keep one each.
+struct CompressionContext {
+    // a chain per worker thread, the deque keeps them in place when more threads come
+    deque<BlockCompressor> blockCompressors;
+    // read blocks whose frames are made, their buffers take the next blocks
+    vector<string> spareBlocks;
+    // Frames of the parallel window, frame k goes to frames[k % window] and finishedFrames
+    // there becomes k once it is made. The sequential mode uses the first one.
+    vector<CompressedFrame> frames;
+    vector<long long> finishedFrames;
+    // of the last call, kept for the capacity
+    vector<FrameIndexEntry> frameIndex;
+    vector<BlockStats> blockStats;
+    vector<uint64_t> fmIndexOffsets;
+};
+
+class Compressor {
+private:
+    mutex queueMutex;
+    condition_variable queueChanged;
+    deque<pair<long long, string> > pendingBlocks;
+    // blocks read but not written yet, bounds both the queue and the frames waiting for the writer
+    long long window;
+    bool inputIsOver;
+    // the first error of a worker, the others stop and the writer rethrows it
+    exception_ptr workerError;
+
+    uint64_t writtenBytes;
+    long long stagePeaks[STAGE_COUNT];
+
+    // the FM-index sidecar goes in frame order to its own stream
+    ostream *fmIndexStream;
+    uint64_t fmIndexBytes;
+
+    CompressionContext ownContext;
+    CompressionContext *context;
+
+private:
+    // Stops the workers and joins them however compressInParallel is left, an error
+    // of the writer would otherwise destroy threads that are still running.
+    class WorkerGuard {
+    private:
+        Compressor &compressor;
+        vector<thread> &workers;
+
+    public:
+        WorkerGuard(Compressor &compressor, vector<thread> &workers) : compressor(compressor), workers(workers) {
+        }
+        ~WorkerGuard();
+    };
+
+private:
+    BlockCompressor &prepareBlockCompressor(int index, const CompressionOptions &options);
+    string takeSpareBlock();
+    void collectStagePeaks(const BlockCompressor &blockCompressor);
+    void writeFrame(ostream &outputStream, const CompressedFrame &frame);
+    void writeFrameIndex(ostream &outputStream);
+    void writeFmIndexTrailer();
+    void compressSequentially(IBlockSource &input, ostream &outputStream, const CompressionOptions &options);
+    void compressInParallel(IBlockSource &input, ostream &outputStream, const CompressionOptions &options);
+    void workerLoop(BlockCompressor &blockCompressor);
+    void writeFinishedFrames(ostream &outputStream, long long &nextFrame, long long lastFrame);
+
+public:
+    // Without a context the compressor keeps its buffers itself, between its own calls.
+    explicit Compressor(CompressionContext *sharedContext = NULL)
+        : fmIndexStream(NULL), context(sharedContext != NULL ? sharedContext : &ownContext) {
+    }
+    // File to file, "-" stands for the standard streams. The FM-index goes to options.fmIndexPath if set.
+    void compress(string inputFile, string outputFile, const CompressionOptions &options);
+    // Writes the whole archive of the input to the stream and its FM-index to the other one if given.
+    // Appending to an existing archive, the streams are positioned at the end of its frames and records.
+    void compress(IBlockSource &input, ostream &outputStream, const CompressionOptions &options,
+                  ostream *fmIndexOutputStream = NULL, const ExistingArchive *existing = NULL);
+    // The biggest heap size seen during every stage over all blocks.
+    const long long *getStagePeaks() const {
+        return stagePeaks;
+    }
+    // Stats of every block in the order of the frames, held by the context until its next call.
+    const vector<BlockStats> &getBlockStats() const {
+        return context->blockStats;
+    }
+
+};
+
+
+string BarrowsWillerTransformator::transform(const string &initialString) {
+    string transformedString;
+    transform(initialString, transformedString);
+    return transformedString;
+}
+
+void BarrowsWillerTransformator::transform(const string &initialString, string &transformedString) {
+    suffarrayBuilder->build(initialString, suffarray);
+    const int SIZE = suffarray.size();
+    transformedString.resize(SIZE);
+
+    const int WALKS = std::min(SIZE, BWT_WALKS);
+    walkStarts.assign(WALKS, 0);
+    for (int i = 0; i < SIZE; ++i) {
+        int index = (suffarray[i] + SIZE - 1) % SIZE;
+        transformedString[i] = initialString[index];
+
+        // the only walk that can start at this position
+        int walk = ((int64_t)suffarray[i] * WALKS + SIZE - 1) / SIZE;
+        if (walk < WALKS && (int64_t)walk * SIZE / WALKS == suffarray[i]) {
+            walkStarts[walk] = i;
+        }
+    }
+    initialStringIndex = walkStarts.empty() ? 0 : walkStarts[0];
+}
+
+bool equalRotations(const string &text, int shift) {
+    const int SIZE = text.size();
+    return memcmp(text.data() + shift, text.data(), SIZE - shift) == 0
+        && memcmp(text.data(), text.data() + SIZE - shift, shift) == 0;
+}
+
+// A block made of k copies of a shorter string u has k equal rows for every rotation of u,
+// and their order depends on the builder. Such rows are only ever handled as one group, so
+// the record keeps the length of u. Equal rotations are neighbours, the row of the whole
+// block is compared with both of them before looking for the period.
+int FmIndexBuilder::findPeriod(const string &initialString, const vector<int> &suffarray, int primaryIndex) {
+    const int SIZE = initialString.size();
+    bool periodic = false;
+    for (int row = primaryIndex - 1; row <= primaryIndex + 1; row += 2) {
+        if (row >= 0 && row < SIZE && equalRotations(initialString, suffarray[row])) {
+            periodic = true;
+        }
+    }
+    if (!periodic) {
+        return SIZE;
+    }
+    vector<int> border(SIZE, 0);
+    for (int i = 1; i < SIZE; ++i) {
+        int length = border[i - 1];
+        while (length > 0 && initialString[i] != initialString[length]) {
+            length = border[length - 1];
+        }
+        border[i] = length + (initialString[i] == initialString[length] ? 1 : 0);
+    }
+    int period = SIZE - border[SIZE - 1];
+    return SIZE % period == 0 ? period : SIZE;
+}
+
+string FmIndexBuilder::build(const string &initialString, const string &transformedString,
+                             const vector<int> &suffarray, int primaryIndex, uint32_t blockChecksum) {
+    const int SIZE = initialString.size();
+    const int PERIOD = SIZE == 0 ? 0 : findPeriod(initialString, suffarray, primaryIndex);
+    const int REPEATS = SIZE == 0 ? 1 : SIZE / PERIOD;
+
+    vector<int> slotOf(ALPHABET_SIZE, -1);
+    string symbols;
+    for (int i = 0; i < SIZE; ++i) {
+        unsigned char symbol = transformedString[i];
+        if (slotOf[symbol] < 0) {
+            slotOf[symbol] = 0;
+            symbols.push_back((char)symbol);
+        }
+    }
+    sort(symbols.begin(), symbols.end(), [](char a, char b) { return (unsigned char)a < (unsigned char)b; });
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        slotOf[(unsigned char)symbols[i]] = i;
+    }
+
+    ostringstream record;
+    writeUint(record, SIZE, 4);
+    writeUint(record, blockChecksum, 4);
+    writeUint(record, PERIOD, 4);
+    writeUint(record, FM_RANK_INTERVAL, 4);
+    writeUint(record, FM_SAMPLE_RATE, 4);
+    writeUint(record, symbols.size(), 2);
+    record << symbols;
+
+    vector<uint32_t> counts(symbols.size(), 0);
+    for (int row = 0; row <= SIZE; ++row) {
+        if (row % FM_RANK_INTERVAL == 0) {
+            for (size_t slot = 0; slot < counts.size(); ++slot) {
+                writeUint(record, counts[slot], 4);
+            }
+        }
+        if (row < SIZE) {
+            ++counts[slotOf[(unsigned char)transformedString[row]]];
+        }
+    }
+
+    // only the first row of every group of equal rotations is sampled, by its position in u
+    vector<uint32_t> samples;
+    for (int word = 0; word < (SIZE + 63) / 64; ++word) {
+        uint64_t bits = 0;
+        for (int row = word * 64; row < std::min(SIZE, word * 64 + 64); ++row) {
+            int position = suffarray[row] % PERIOD;
+            if (row % REPEATS == 0 && position % FM_SAMPLE_RATE == 0) {
+                bits |= (uint64_t)1 << (row - word * 64);
+                samples.push_back(position);
+            }
+        }
+        writeUint(record, bits, 8);
+    }
+    writeUint(record, samples.size(), 4);
+    for (size_t i = 0; i < samples.size(); ++i) {
+        writeUint(record, samples[i], 4);
+    }
+    return record.str();
+}
+
+int MoveToFrontTransformator::findRank(unsigned char symbol) const {
+#ifdef __SSE2__
+    __m128i pattern = _mm_set1_epi8((char)symbol);
+    for (int offset = 0; offset < ALPHABET_SIZE; offset += 16) {
+        __m128i chunk = _mm_load_si128((const __m128i *)(recency + offset));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern));
+        if (mask != 0) {
+            return offset + __builtin_ctz(mask);
+        }
+    }
+    return -1;
+#else
+    return (const unsigned char *)memchr(recency, symbol, ALPHABET_SIZE) - recency;
+#endif
+}
+
+string MoveToFrontTransformator::transform(const string &initialString) {
+    string transformedString;
+    transform(initialString, transformedString);
+    return transformedString;
+}
+
+void MoveToFrontTransformator::transform(const string &initialString, string &transformedString) {
+    for (int i = 0; i < ALPHABET_SIZE; ++i) {
+        recency[i] = (unsigned char)i;
+    }
+    transformedString.resize(initialString.size());
+    char *output = &transformedString[0];
+
+    for (size_t i = 0; i < initialString.size(); ++i) {
+        unsigned char symbol = initialString[i];
+        // after BWT most symbols repeat the previous one
+        if (recency[0] == symbol) {
+            output[i] = 0;
+            continue;
+        }
+        int rank = findRank(symbol);
+        memmove(recency + 1, recency, rank);
+        recency[0] = symbol;
+        output[i] = (char)rank;
+    }
+}
+
+void ZeroRunLengthCoder::transform(const string &ranks, vector<uint16_t> &symbols) {
+    symbols.clear();
+    symbols.reserve(ranks.size() / 2 + 1);
+
+    size_t runLength = 0;
+    for (size_t i = 0; i <= ranks.size(); ++i) {
+        if (i < ranks.size() && ranks[i] == 0) {
+            ++runLength;
+            continue;
+        }
+        if (runLength > 0) {
+            // digits go from the lowest one: run = sum of (digit + 1) * 2^position
+            for (--runLength;; runLength = (runLength - 2) / 2) {
+                symbols.push_back((runLength & 1) ? RUN_B : RUN_A);
+                if (runLength < 2) {
+                    break;
+                }
+            }
+            runLength = 0;
+        }
+        if (i < ranks.size()) {
+            symbols.push_back((unsigned char)ranks[i] + 1);
+        }
+    }
+}
+
+void InputFile::open(const string &path) {
+    close();
+    if (path == "-") {
+        descriptor = STDIN_FILENO;
+    }
+    else {
+        descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            throw runtime_error("cannot open " + path + ": " + strerror(errno));
+        }
+        ownsDescriptor = true;
+    }
+
+    struct stat fileStatus;
+    if (fstat(descriptor, &fileStatus) == 0 && S_ISREG(fileStatus.st_mode) && fileStatus.st_size > 0) {
+        void *address = mmap(NULL, fileStatus.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (address != MAP_FAILED) {
+            madvise(address, fileStatus.st_size, MADV_SEQUENTIAL);
+            mapped = (const char *)address;
+            mappedSize = fileStatus.st_size;
+        }
+    }
+}
+
+// Reads at most blockSize bytes, returns false once the input is over.
+bool InputFile::readBlock(string &block, size_t blockSize) {
+    if (mapped != NULL) {
+        size_t size = std::min(blockSize, mappedSize - position);
+        block.assign(mapped + position, size);
+        position += size;
+        // pages already copied out would otherwise stay resident until the end
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        madvise((void *)mapped, position / pageSize * pageSize, MADV_DONTNEED);
+        return position < mappedSize;
+    }
+
+    block.resize(blockSize);
+    size_t size = 0;
+    while (size < blockSize) {
+        ssize_t count = read(descriptor, &block[size], blockSize - size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            throw runtime_error(string("cannot read the input: ") + strerror(errno));
+        }
+        if (count == 0) {
+            break;
+        }
+        size += count;
+    }
+    block.resize(size);
+    return size == blockSize;
+}
+
+void InputFile::close() {
+    if (mapped != NULL) {
+        munmap((void *)mapped, mappedSize);
+    }
+    if (ownsDescriptor) {
+        ::close(descriptor);
+    }
+    descriptor = -1;
+    ownsDescriptor = false;
+    mapped = NULL;
+    mappedSize = 0;
+    position = 0;
+}
+
+void Compressor::compressSequentially(IBlockSource &input, ostream &outputStream,
+                                      const CompressionOptions &options) {
+    BlockCompressor &blockCompressor = prepareBlockCompressor(0, options);
+    if (context->frames.empty()) {
+        context->frames.resize(1);
+    }
+
+    string block = takeSpareBlock();
+    bool hasMoreData = true;
+    while (hasMoreData) {
+        hasMoreData = input.readBlock(block, options.blockSize);
+        if (block.empty()) {
+            break;
+        }
+        blockCompressor.compressBlock(block, context->frames[0]);
+        writeFrame(outputStream, context->frames[0]);
+    }
+    context->spareBlocks.push_back(std::move(block));
+    collectStagePeaks(blockCompressor);
+}
+
+void Compressor::workerLoop(BlockCompressor &blockCompressor) {
+    unique_lock<mutex> lock(queueMutex);
+    while (true) {
+        queueChanged.wait(lock, [this] { return !pendingBlocks.empty() || inputIsOver; });
+        if (pendingBlocks.empty()) {
+            return;
+        }
+        pair<long long, string> job = std::move(pendingBlocks.front());
+        pendingBlocks.pop_front();
+
+        lock.unlock();
+        // nobody else touches the slot until the writer waits for this frame
+        try {
+            blockCompressor.compressBlock(job.second, context->frames[job.first % window]);
+        }
+        catch (...) {
+            lock.lock();
+            if (!workerError) {
+                workerError = current_exception();
+            }
+            pendingBlocks.clear();
+            inputIsOver = true;
+            queueChanged.notify_all();
+            return;
+        }
+        lock.lock();
+
+        context->spareBlocks.push_back(std::move(job.second));
+        context->finishedFrames[job.first % window] = job.first;
+        queueChanged.notify_all();
+    }
+}
+
+// Writes frames in input order while waiting until everything before lastFrame is written.
+void Compressor::writeFinishedFrames(ostream &outputStream, long long &nextFrame, long long lastFrame) {
+    unique_lock<mutex> lock(queueMutex);
+    while (nextFrame < lastFrame) {
+        long long slot = nextFrame % window;
+        queueChanged.wait(lock, [this, slot, nextFrame] {
+            return context->finishedFrames[slot] == nextFrame || workerError;
+        });
+        if (workerError) {
+            rethrow_exception(workerError);
+        }
+        ++nextFrame;
+
+        // the slot is taken again only by a block read after this write
+        lock.unlock();
+        writeFrame(outputStream, context->frames[slot]);
+        lock.lock();
+    }
+}
+
+void Compressor::compressInParallel(IBlockSource &input, ostream &outputStream, const CompressionOptions &options) {
+    window = 2 * options.threads;
+    if ((long long)context->frames.size() < window) {
+        context->frames.resize(window);
+    }
+    context->finishedFrames.assign(window, -1);
+
+    inputIsOver = false;
+    workerError = exception_ptr();
+    pendingBlocks.clear();
+    vector<thread> workers;
+    WorkerGuard workerGuard(*this, workers);
+    for (int i = 0; i < options.threads; ++i) {
+        BlockCompressor &blockCompressor = prepareBlockCompressor(i, options);
+        workers.push_back(thread(&Compressor::workerLoop, this, std::ref(blockCompressor)));
+    }
+
+    long long nextFrame = 0, readFrames = 0;
+    bool hasMoreData = true;
+    while (hasMoreData) {
+        string block;
+        {
+            lock_guard<mutex> lock(queueMutex);
+            block = takeSpareBlock();
+        }
+        hasMoreData = input.readBlock(block, options.blockSize);
+        if (block.empty()) {
+            break;
+        }
+        writeFinishedFrames(outputStream, nextFrame, readFrames - window + 1);
+
+        lock_guard<mutex> lock(queueMutex);
+        pendingBlocks.push_back(make_pair(readFrames++, std::move(block)));
+        queueChanged.notify_all();
+    }
+    {
+        lock_guard<mutex> lock(queueMutex);
+        inputIsOver = true;
+        queueChanged.notify_all();
+    }
+    writeFinishedFrames(outputStream, nextFrame, readFrames);
+
+    for (int i = 0; i < options.threads; ++i) {
+        workers[i].join();
+        collectStagePeaks(context->blockCompressors[i]);
+    }
+}
+
+// Blocks nobody is waiting for any more are dropped, the workers finish the ones they hold.
+Compressor::WorkerGuard::~WorkerGuard() {
+    {
+        lock_guard<mutex> lock(compressor.queueMutex);
+        compressor.pendingBlocks.clear();
+        compressor.inputIsOver = true;
+        compressor.queueChanged.notify_all();
+    }
+    for (size_t i = 0; i < workers.size(); ++i) {
+        if (workers[i].joinable()) {
+            workers[i].join();
+        }
+    }
+}
+
+BlockCompressor &Compressor::prepareBlockCompressor(int index, const CompressionOptions &options) {
+    while (context->blockCompressors.size() <= (size_t)index) {
+        context->blockCompressors.emplace_back();
+    }
+    BlockCompressor &blockCompressor = context->blockCompressors[index];
+    blockCompressor.setSuffarrayBuilder(options.suffarrayBuilder);
+    blockCompressor.setZeroRuns(options.zeroRuns);
+    blockCompressor.setFmIndex(fmIndexStream != NULL);
+    blockCompressor.setEntropyCoder(options.entropyCoder);
+    blockCompressor.resetStagePeaks();
+    return blockCompressor;
+}
+
+// The parallel mode calls it under the queue lock.
+string Compressor::takeSpareBlock() {
+    string block;
+    if (!context->spareBlocks.empty()) {
+        block.swap(context->spareBlocks.back());
+        context->spareBlocks.pop_back();
+    }
+    return block;
+}
+
+void Compressor::collectStagePeaks(const BlockCompressor &blockCompressor) {
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        stagePeaks[stage] = std::max(stagePeaks[stage], blockCompressor.getStagePeaks()[stage]);
+    }
+}
+
+void Compressor::writeFrame(ostream &outputStream, const CompressedFrame &frame) {
+    FrameIndexEntry entry;
+    entry.offset = writtenBytes;
+    entry.size = frame.data.size();
+    entry.blockLength = frame.blockLength;
+    context->frameIndex.push_back(entry);
+    context->blockStats.push_back(frame.stats);
+
+    outputStream << frame.data;
+    writtenBytes += frame.data.size();
+
+    if (fmIndexStream != NULL) {
+        context->fmIndexOffsets.push_back(fmIndexBytes);
+        *fmIndexStream << frame.fmIndex;
+        fmIndexBytes += frame.fmIndex.size();
+    }
+}
+
+// Footer: (offset, size, block length) of every frame, frame count, index offset and the magic.
+void Compressor::writeFrameIndex(ostream &outputStream) {
+    writeArchiveIndex(outputStream, context->frameIndex, writtenBytes,
+                      fmIndexStream != NULL ? FM_INDEXED_ARCHIVE_MAGIC : ARCHIVE_MAGIC);
+}
+
+// Laid out like the archive: record offsets, their count, where they start and the magic.
+void Compressor::writeFmIndexTrailer() {
+    for (size_t i = 0; i < context->fmIndexOffsets.size(); ++i) {
+        writeUint(*fmIndexStream, context->fmIndexOffsets[i], 8);
+    }
+    writeUint(*fmIndexStream, context->fmIndexOffsets.size(), 8);
+    writeUint(*fmIndexStream, fmIndexBytes, 8);
+    *fmIndexStream << FM_INDEX_MAGIC;
+}
+
+// Closes the output of a failed append, cuts the file back to its old frames and writes their
+// index after them again. The cut comes first, so the index fits into the space it frees.
+void discardAppended(OutputFileBuffer &outputBuffer, const string &path, uint64_t framesEnd,
+                     const string &indexBytes, const exception &error) {
+    try {
+        outputBuffer.close();
+    }
+    catch (const exception &) {
+    }
+    try {
+        if (truncate(path.c_str(), framesEnd) != 0) {
+            throw runtime_error(strerror(errno));
+        }
+        outputBuffer.openAt(path, framesEnd);
+        outputBuffer.sputn(indexBytes.data(), indexBytes.size());
+        outputBuffer.close();
+    }
+    catch (const exception &restoreError) {
+        throw runtime_error(string(error.what()) + ", and " + path + " could not be restored: " + restoreError.what());
+    }
+}
+
+void Compressor::compress(string inputFile, string outputFile, const CompressionOptions &options) {
+    InputFile aliceFile;
+    aliceFile.open(inputFile);
+    // appending to an archive that is not there yet starts it
+    ExistingArchive existingArchive;
+    bool appending = options.append && access(outputFile.c_str(), F_OK) == 0;
+    if (appending) {
+        existingArchive = readExistingArchive(outputFile, options.fmIndexPath);
+    }
+
+    OutputFileBuffer compressedOutputBuffer;
+    OutputFileBuffer fmIndexBuffer;
+    bool withFmIndex = !options.fmIndexPath.empty();
+    try {
+        if (appending) {
+            compressedOutputBuffer.openAt(outputFile, existingArchive.framesEnd);
+        }
+        else {
+            compressedOutputBuffer.open(outputFile);
+        }
+        if (withFmIndex && appending) {
+            fmIndexBuffer.openAt(options.fmIndexPath, existingArchive.fmIndexRecordsEnd);
+        }
+        else if (withFmIndex) {
+            fmIndexBuffer.open(options.fmIndexPath);
+        }
+        ostream compressedOutputStream(&compressedOutputBuffer);
+        ostream fmIndexOutputStream(&fmIndexBuffer);
+        compress(aliceFile, compressedOutputStream, options, withFmIndex ? &fmIndexOutputStream : NULL,
+                 appending ? &existingArchive : NULL);
+        compressedOutputBuffer.close();
+        fmIndexBuffer.close();
+    }
+    catch (const exception &error) {
+        if (appending) {
+            discardAppended(compressedOutputBuffer, outputFile, existingArchive.framesEnd, existingArchive.indexBytes,
+                            error);
+            if (withFmIndex) {
+                discardAppended(fmIndexBuffer, options.fmIndexPath, existingArchive.fmIndexRecordsEnd,
+                                existingArchive.fmIndexBytes, error);
+            }
+        }
+        throw;
+    }
+}
+
+void Compressor::compress(IBlockSource &input, ostream &outputStream, const CompressionOptions &options,
+                          ostream *fmIndexOutputStream, const ExistingArchive *existing) {
+    checkOptions(options);
+    // errors of the stream buffer reach the caller as they are
+    outputStream.exceptions(std::ios::badbit);
+    context->frameIndex.clear();
+    context->blockStats.clear();
+    writtenBytes = 0;
+    fill(stagePeaks, stagePeaks + STAGE_COUNT, 0);
+    fmIndexStream = fmIndexOutputStream;
+    context->fmIndexOffsets.clear();
+    fmIndexBytes = 0;
+    if (existing != NULL) {
+        context->frameIndex = existing->frameIndex;
+        writtenBytes = existing->framesEnd;
+        context->fmIndexOffsets = existing->fmIndexOffsets;
+        fmIndexBytes = existing->fmIndexRecordsEnd;
+    }
+    if (fmIndexStream != NULL) {
+        fmIndexStream->exceptions(std::ios::badbit);
+    }
+
+    if (options.threads > 1) {
+        compressInParallel(input, outputStream, options);
+    }
+    else {
+        compressSequentially(input, outputStream, options);
+    }
+    writeFrameIndex(outputStream);
+    outputStream.flush();
+    if (fmIndexStream != NULL) {
+        writeFmIndexTrailer();
+        fmIndexStream->flush();
+        fmIndexStream = NULL;
+    }
+}
+
+// Replaces the contents of output with the archive of size bytes at data. The working memory
+// comes from the context and stays there for the next call with it.
+void compressBuffer(const uint8_t *data, size_t size, vector<uint8_t> &output, CompressionContext &context,
+                    const CompressionOptions &options = CompressionOptions()) {
+    output.clear();
+    MemoryInput input(data, size);
+    VectorOutputBuffer outputBuffer(output);
+    ostream outputStream(&outputBuffer);
+    Compressor compressor(&context);
+    compressor.compress(input, outputStream, options);
+}
+
+// The same into a buffer of the given capacity, returns the size of the archive.
+size_t compressBuffer(const uint8_t *data, size_t size, uint8_t *output, size_t capacity,
+                      CompressionContext &context, const CompressionOptions &options = CompressionOptions()) {
+    MemoryInput input(data, size);
+    ArrayOutputBuffer outputBuffer(output, capacity);
+    ostream outputStream(&outputBuffer);
+    Compressor compressor(&context);
+    compressor.compress(input, outputStream, options);
+    return outputBuffer.size();
+}
+
+// Both without a context: every call works on its own state, so any number of them may run at once.
+void compressBuffer(const uint8_t *data, size_t size, vector<uint8_t> &output,
+                    const CompressionOptions &options = CompressionOptions()) {
+    CompressionContext context;
+    compressBuffer(data, size, output, context, options);
+}
+
+size_t compressBuffer(const uint8_t *data, size_t size, uint8_t *output, size_t capacity,
+                      const CompressionOptions &options = CompressionOptions()) {
+    CompressionContext context;
+    return compressBuffer(data, size, output, capacity, context, options);
+}
+
+// Accepts plain byte counts as well as "K", "M" and "G" suffixes: "900K", "64M".
+long long parseSize(const string &value) {
+    char *suffix;
+    long long size = strtoll(value.c_str(), &suffix, 10);
+    if (*suffix == 'K' || *suffix == 'k') {
+        size <<= 10;
+    }
+    else if (*suffix == 'M' || *suffix == 'm') {
+        size <<= 20;
+    }
+    else if (*suffix == 'G' || *suffix == 'g') {
+        size <<= 30;
+    }
+    return size;
+}
+
+// Peak of one block per input byte for every suffix array builder, measured with
+// --memory-report on text, DNA, periodic and random data of 1M to 16M blocks. The builders
+// keep their arrays between blocks, so the peak comes in the later stages on top of them:
+// SA-IS holds the rotated block, the suffix array and the LMS arrays of every recursion
+// level, at most 18 bytes per symbol, prefix doubling five int arrays of the block size.
+long long estimateBlockMemory(const string &suffarrayBuilder, long long blockSize) {
+    const long long BYTES_PER_SYMBOL = suffarrayBuilder == "sais" ? SAIS_BYTES_PER_SYMBOL : DOUBLING_BYTES_PER_SYMBOL;
+    return BYTES_PER_SYMBOL * blockSize;
+}
+
+// Index entry, stats and FM-index offset kept for every frame until the end of the run,
+// twice over since the vectors grow by doubling.
+const long long FRAME_MEMORY = 2 * (sizeof(FrameIndexEntry) + sizeof(BlockStats) + sizeof(uint64_t));
+
+// Whole process: every worker holds a block at its peak and its coder tables, the window of
+// the parallel mode keeps two more blocks and frames per worker, the frame index grows with
+// the input, plus the code, the libraries and the output buffer. A stream of unknown size
+// counts as empty.
+long long estimateMemory(const string &suffarrayBuilder, long long blockSize, int threads, uint64_t inputSize) {
+    long long perThread = estimateBlockMemory(suffarrayBuilder, blockSize) + THREAD_MEMORY;
+    long long queuedBlocks = threads > 1 ? 2 * threads * 2 * blockSize : 0;
+    long long frames = (inputSize + blockSize - 1) / blockSize;
+    return threads * perThread + queuedBlocks + frames * FRAME_MEMORY + FIXED_MEMORY;
+}
+
+// Picks the builder allowing the biggest block no bigger than the requested one, then
+// drops worker threads until some block fits. Returns false if nothing fits.
+bool fitMemoryLimit(CompressionOptions &options, uint64_t inputSize) {
+    const string BUILDERS[] = { "sais", "doubling" };
+    while (true) {
+        int bestBlockSize = 0;
+        for (int i = 0; i < 2; ++i) {
+            // the frame index shrinks as the blocks grow, so the estimate falls until the
+            // blocks are about this big and only then grows with them
+            double bytesPerSymbol = estimateMemory(BUILDERS[i], 2, options.threads, 0)
+                                    - estimateMemory(BUILDERS[i], 1, options.threads, 0);
+            double cheapestBlockSize = sqrt(FRAME_MEMORY * (double)inputSize / bytesPerSymbol);
+            int low = (int)std::max((double)MIN_BLOCK_SIZE, std::min((double)options.blockSize, cheapestBlockSize));
+            if (estimateMemory(BUILDERS[i], low, options.threads, inputSize) > options.memoryLimit) {
+                continue;
+            }
+            int high = options.blockSize;
+            while (low < high) {
+                int middle = low + (high - low + 1) / 2;
+                if (estimateMemory(BUILDERS[i], middle, options.threads, inputSize) <= options.memoryLimit) {
+                    low = middle;
+                }
+                else {
+                    high = middle - 1;
+                }
+            }
+            if (low > bestBlockSize) {
+                bestBlockSize = low;
+                options.suffarrayBuilder = BUILDERS[i];
+            }
+        }
+        if (bestBlockSize >= MIN_BLOCK_SIZE) {
+            options.blockSize = bestBlockSize;
+            return true;
+        }
+        if (options.threads == 1) {
+            return false;
+        }
+        --options.threads;
+    }
+}
+
+// Size of a regular file, zero for the standard input and other streams.
+uint64_t inputSizeOf(const string &path) {
+    struct stat fileStatus;
+    if (path == "-" || stat(path.c_str(), &fileStatus) != 0 || !S_ISREG(fileStatus.st_mode)) {
+        return 0;
+    }
+    return fileStatus.st_size;
+}
+
+// Packs many small records into shared blocks, so the suffix array and the entropy tables
+// are paid once per block instead of once per record. A record starts a new block rather
+// than straddle two, unless it is bigger than a block. Records get numbers in the order
+// they come and are read back one by one with Decompressor::readRecord.
+class RecordBatchCompressor {
+private:
+    ostream &outputStream;
+    int blockSize;
+    BlockCompressor blockCompressor;
+    string block;
+    CompressedFrame frame;
+    vector<FrameIndexEntry> frameIndex;
+    string recordTable;
+    uint64_t recordCount;
+    uint64_t writtenBytes;
+
+private:
+    void compressBlock(size_t length);
+
+public:
+    RecordBatchCompressor(ostream &outputStream, const CompressionOptions &options);
+    // Returns the number of the record.
+    uint64_t addRecord(const uint8_t *data, size_t size);
+    // Compresses the last block and writes the tables, no records may follow.
+    void finish();
+};
+
+RecordBatchCompressor::RecordBatchCompressor(ostream &outputStream, const CompressionOptions &options)
+    : outputStream(outputStream), blockSize(options.blockSize), recordCount(0), writtenBytes(0) {
+    checkOptions(options);
+    outputStream.exceptions(std::ios::badbit);
+    blockCompressor.setSuffarrayBuilder(options.suffarrayBuilder);
+    blockCompressor.setZeroRuns(options.zeroRuns);
+    blockCompressor.setEntropyCoder(options.entropyCoder);
+}
+
+// Compresses the first length bytes of the pending block as one frame.
+void RecordBatchCompressor::compressBlock(size_t length) {
+    blockCompressor.compressBlock(length == block.size() ? block : block.substr(0, length), frame);
+    FrameIndexEntry entry;
+    entry.offset = writtenBytes;
+    entry.size = frame.data.size();
+    entry.blockLength = frame.blockLength;
+    frameIndex.push_back(entry);
+    outputStream << frame.data;
+    writtenBytes += frame.data.size();
+    block.erase(0, length);
+}
+
+uint64_t RecordBatchCompressor::addRecord(const uint8_t *data, size_t size) {
+    if (!block.empty() && block.size() + size > (size_t)blockSize) {
+        compressBlock(block.size());
+    }
+    block.append((const char *)data, size);
+    while (block.size() > (size_t)blockSize) {
+        compressBlock(blockSize);
+    }
+    for (uint64_t length = size; ; length >>= 7) {
+        if (length < 0x80) {
+            recordTable.push_back((char)length);
+            break;
+        }
+        recordTable.push_back((char)((length & 0x7f) | 0x80));
+    }
+    return recordCount++;
+}
+
+void RecordBatchCompressor::finish() {
+    if (!block.empty()) {
+        compressBlock(block.size());
+    }
+    uint64_t tableOffset = writtenBytes;
+    outputStream << recordTable;
+    writeUint(outputStream, recordCount, 8);
+    writeUint(outputStream, tableOffset, 8);
+    outputStream << RECORD_TABLE_MAGIC;
+    writtenBytes += recordTable.size() + 16 + RECORD_TABLE_MAGIC.size();
+    writeArchiveIndex(outputStream, frameIndex, writtenBytes);
+    outputStream.flush();
+}
+
+// --line-records: every line with its line feed is a record.
+void compressLineRecords(const string &inputFile, const string &outputFile, const CompressionOptions &options) {
+    InputFile input;
+    input.open(inputFile);
+    OutputFileBuffer outputBuffer;
+    outputBuffer.open(outputFile);
+    ostream outputStream(&outputBuffer);
+    RecordBatchCompressor batchCompressor(outputStream, options);
+
+    string chunk;
+    string line;
+    bool hasMoreData = true;
+    while (hasMoreData) {
+        hasMoreData = input.readBlock(chunk, options.blockSize);
+        size_t start = 0;
+        for (size_t end = chunk.find('\n'); end != string::npos; end = chunk.find('\n', start)) {
+            line.append(chunk, start, end + 1 - start);
+            batchCompressor.addRecord((const uint8_t *)line.data(), line.size());
+            line.clear();
+            start = end + 1;
+        }
+        line.append(chunk, start, string::npos);
+    }
+    if (!line.empty()) {
+        batchCompressor.addRecord((const uint8_t *)line.data(), line.size());
+    }
+    batchCompressor.finish();
+    outputBuffer.close();
+}
+
+void printMemoryReport(const Compressor &compressor, const CompressionOptions &options, uint64_t inputSize) {
+    cerr << "block size " << options.blockSize << ", bwt " << options.suffarrayBuilder
+         << ", threads " << options.threads << endl;
+    if (options.memoryLimit > 0) {
+        cerr << "estimated peak "
+             << estimateMemory(options.suffarrayBuilder, options.blockSize, options.threads, inputSize)
+             << " of " << options.memoryLimit << " bytes" << endl;
+    }
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        cerr << "heap peak during " << STAGE_NAMES[stage] << ": " << compressor.getStagePeaks()[stage] << endl;
+    }
+    cerr << "heap peak: " << runPeakHeapBytes.load() << endl;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    cerr << "peak resident set: " << (long long)usage.ru_maxrss * 1024 << endl;
+}
+
+// benchmark.cpp includes this file with COMPRESSIT_NO_MAIN and brings its own main.
+#ifndef COMPRESSIT_NO_MAIN
+int main(int argc, char *argv[]) {
+    CompressionOptions options;
+    vector<string> paths;
+    for (int i = 1; i < argc; ++i) {
+        string argument = argv[i];
+        if (argument == "-" || argument[0] != '-') {
+            paths.push_back(argument);
+        }
+        else if (argument == "--block-size" && i + 1 < argc) {
+            options.blockSize = (int)std::min(parseSize(argv[++i]), (long long)MAX_BLOCK_SIZE + 1);
+        }
+        else if (argument == "--bwt" && i + 1 < argc) {
+            options.suffarrayBuilder = argv[++i];
+        }
+        else if (argument == "--threads" && i + 1 < argc) {
+            options.threads = atoi(argv[++i]);
+            if (options.threads == 0) {
+                options.threads = std::max(1u, thread::hardware_concurrency());
+            }
+        }
+        else if (argument == "--no-zero-runs") {
+            options.zeroRuns = false;
+        }
+        else if (argument == "--entropy" && i + 1 < argc) {
+            options.entropyCoder = argv[++i];
+        }
+        else if (argument == "--memory-limit" && i + 1 < argc) {
+            options.memoryLimit = parseSize(argv[++i]);
+        }
+        else if (argument == "--memory-report") {
+            options.memoryReport = true;
+        }
+        else if (argument == "--stats" && i + 1 < argc) {
+            options.statsFormat = argv[++i];
+        }
+        else if (argument == "--fm-index" && i + 1 < argc) {
+            options.fmIndexPath = argv[++i];
+        }
+        else if (argument == "--line-records") {
+            options.lineRecords = true;
+        }
+        else if (argument == "--append") {
+            options.append = true;
+        }
+        else {
+            cerr << "usage: " << argv[0] << " [--block-size SIZE] [--bwt sais|doubling] [--threads N]"
+                 << " [--no-zero-runs] [--entropy auto|haffman|ans] [--memory-limit SIZE] [--memory-report]"
+                 << " [--stats json] [--fm-index PATH] [--line-records] [--append]"
+                 << " [INPUT [OUTPUT]]" << endl;
+            return 1;
+        }
+    }
+    if (paths.size() > 2) {
+        cerr << "expected at most an input and an output path, \"-\" for the standard streams" << endl;
+        return 1;
+    }
+    try {
+        checkOptions(options);
+    }
+    catch (const exception &error) {
+        cerr << error.what() << endl;
+        return 1;
+    }
+    if (options.lineRecords && !options.fmIndexPath.empty()) {
+        cerr << "records and the FM index cannot be written together" << endl;
+        return 1;
+    }
+
+    string inputFile = paths.size() > 0 ? paths[0] : "input.txt";
+    string outputFile = paths.size() > 1 ? paths[1] : "compressed.txt";
+    uint64_t inputSize = inputSizeOf(inputFile);
+    if (options.memoryLimit != 0 && !fitMemoryLimit(options, inputSize)) {
+        cerr << "memory limit is too small even for 1K blocks in one thread" << endl;
+        return 1;
+    }
+    if (options.append && (outputFile == "-" || options.lineRecords)) {
+        cerr << "only an archive file without records can be appended to" << endl;
+        return 1;
+    }
+
+    // batches go one block at a time through a single thread
+    if (options.lineRecords) {
+        try {
+            compressLineRecords(inputFile, outputFile, options);
+        }
+        catch (const exception &error) {
+            cerr << error.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    Compressor compressor;
+    try {
+        compressor.compress(inputFile, outputFile, options);
+    }
+    catch (const exception &error) {
+        cerr << error.what() << endl;
+        return 1;
+    }
+    if (options.memoryReport) {
+        printMemoryReport(compressor, options, inputSize);
+    }
+    if (options.statsFormat == "json") {
+        printStatsJson(cerr, compressor.getBlockStats());
+    }
     return 0;
 }
+#endif
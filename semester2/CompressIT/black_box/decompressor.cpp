@@ -1,269 +1,1434 @@
 #include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <queue>
-#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <stdexcept>
+#include <exception>
+#include <sstream>
+#include <cstring>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
 
 using namespace std;
 
-const int C_SIZE = sizeof ((char)1);
-const string ALLOWED_SYMBOLS = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ ()':,.!?\"";
-const int ALPHABET_SIZE = ALLOWED_SYMBOLS.size();
+// Any byte is a symbol, symbol tables are flat arrays indexed by the byte value.
+const int ALPHABET_SIZE = 256;
+// After zero-run coding: RUNA, RUNB and the MTF ranks 1..255 shifted by one.
+const int RUN_A = 0;
+const int RUN_B = 1;
+const int ZERO_RUN_ALPHABET_SIZE = ALPHABET_SIZE + 1;
 
-unordered_map<char, int> symbolToIndex;
+const int FRAME_FLAG_ZERO_RUNS = 1;
 
-int readNumber(istream &inputStream);
-string readBinaryString(istream &inputStream);
+// Entropy coder ids stored in every frame header.
+const int ENTROPY_HAFFMAN = 0;
+const int ENTROPY_ANS = 1;
 
-class BarrowsWillerTransformator {
+const int ANS_MAX_TABLE_LOG = 15;
+
+const int BWT_MAX_WALKS = 16;
+
+// Limit of the compressor, a frame header claiming a longer block is corrupted.
+const uint32_t MAX_BLOCK_LENGTH = 64 << 20;
+
+const string ARCHIVE_MAGIC = "CIT1";
+// archives written together with an FM-index sidecar
+const string FM_INDEXED_ARCHIVE_MAGIC = "CIF1";
+const string RECORD_TABLE_MAGIC = "CRT1";
+const int RECORD_TABLE_TRAILER_SIZE = 20;
+const int ARCHIVE_TRAILER_SIZE = 8 + 8 + 4;
+
+const int HAFFMAN_TABLE_BITS = 11;
+// Limit of the compressor, codes never need more than two table levels.
+const int HAFFMAN_MAX_CODE_LENGTH = 20;
+
+// Stages of a block reported by --stats.
+enum DecompressionStage { STAGE_ENTROPY, STAGE_ZERO_RUNS, STAGE_MTF, STAGE_BWT, STAGE_COUNT };
+const char *const STAGE_NAMES[STAGE_COUNT] = { "entropy", "zero-runs", "mtf", "bwt" };
+
+uint64_t readUint(istream &inputStream, int bytes);
+
+struct DecompressionOptions {
+    int threads;
+    string statsFormat;
+    // restore only rangeLength bytes from rangeOffset when set
+    bool range;
+    uint64_t rangeOffset;
+    uint64_t rangeLength;
+    // restore only this record of a batch when not negative
+    long long record;
+
+    DecompressionOptions() : threads(1), range(false), rangeOffset(0), rangeLength(0), record(-1) {
+    }
+};
+
+void checkOptions(const DecompressionOptions &options) {
+    if (options.threads < 1) {
+        throw runtime_error("thread count must be positive, 0 picks one per core");
+    }
+    if (!options.statsFormat.empty() && options.statsFormat != "json") {
+        throw runtime_error("unknown stats format: " + options.statsFormat);
+    }
+}
+
+#include "common.h"
+
+struct FrameIndexEntry {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t blockLength;
+};
+
+// The whole archive in memory: regular files are mapped, pipes are read with large read
+// calls since the frame index sits at the very end. "-" stands for the standard input.
+class InputFile {
+private:
+    const char *mapped;
+    size_t mappedSize;
+    vector<char> buffer;
+
+public:
+    InputFile() : mapped(NULL), mappedSize(0) {
+    }
+    ~InputFile() {
+        close();
+    }
+    void open(const string &path);
+    void close();
+    const char *data() const {
+        return mapped != NULL ? mapped : buffer.data();
+    }
+    size_t size() const {
+        return mapped != NULL ? mappedSize : buffer.size();
+    }
+};
+
+// Lets the frame parsers read straight from the archive in memory, every reader owns its own.
+class MemoryInputBuffer : public streambuf {
+protected:
+    virtual pos_type seekoff(off_type offset, ios_base::seekdir direction, ios_base::openmode mode) {
+        off_type position = offset;
+        if (direction == ios_base::cur) {
+            position += gptr() - eback();
+        }
+        else if (direction == ios_base::end) {
+            position += egptr() - eback();
+        }
+        return seekpos(position, mode);
+    }
+    virtual pos_type seekpos(pos_type position, ios_base::openmode) {
+        if (position < 0 || position > egptr() - eback()) {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), eback() + (off_type)position, egptr());
+        return position;
+    }
+
+public:
+    MemoryInputBuffer() {
+    }
+    MemoryInputBuffer(const char *data, size_t size) {
+        open(data, size);
+    }
+    void open(const char *data, size_t size) {
+        char *begin = const_cast<char *>(data);
+        setg(begin, begin, begin + size);
+    }
+};
+
+// Where the restored blocks go.
+class IOutputSink {
+public:
+    // Whether blocks may be placed at their offsets in any order.
+    virtual bool isSeekable() const = 0;
+    // Places data at the given offset, safe from several threads.
+    virtual void writeAt(uint64_t offset, const char *data, size_t size) = 0;
+    // Appends data after everything written so far.
+    virtual void write(const char *data, size_t size) = 0;
+    virtual ~IOutputSink() {
+    }
+};
+
+// The output file as a sink, the parallel mode places its blocks with pwrite.
+class OutputFileSink : public IOutputSink {
 private:
-    int initialStringIndex;
+    OutputFileBuffer &outputBuffer;
 
 public:
-    string decode(const string &transformedString, int initialStringIndex);
-    int getInitialStringIndex() {
-        return initialStringIndex;
+    explicit OutputFileSink(OutputFileBuffer &outputBuffer) : outputBuffer(outputBuffer) {
+    }
+    bool isSeekable() const {
+        return outputBuffer.isSeekable();
+    }
+    void writeAt(uint64_t offset, const char *data, size_t size) {
+        outputBuffer.writeAt(offset, data, size);
+    }
+    void write(const char *data, size_t size) {
+        outputBuffer.sputn(data, size);
+    }
+};
+
+// A buffer given by the caller, big enough for the whole output.
+class MemoryOutput : public IOutputSink {
+private:
+    char *buffer;
+    size_t capacity;
+    size_t position;
+
+public:
+    MemoryOutput(char *buffer, size_t capacity) : buffer(buffer), capacity(capacity), position(0) {
+    }
+    bool isSeekable() const {
+        return true;
     }
-    void setInitialStringIndex(int index) {
-        initialStringIndex = index;
+    void writeAt(uint64_t offset, const char *data, size_t size) {
+        if (offset > capacity || size > capacity - offset) {
+            throw runtime_error("output buffer is too small");
+        }
+        memcpy(buffer + offset, data, size);
+    }
+    void write(const char *data, size_t size) {
+        writeAt(position, data, size);
+        position += size;
     }
 };
 
+// Each row packs the next row of the walk over the text with the symbol it starts with, so a
+// step is one memory access. Several walks, each restoring its own slice of the block, run
+// interleaved to keep that many cache misses in flight.
+class BarrowsWillerTransformator {
+private:
+    vector<uint32_t> walkStarts;
+    vector<uint32_t> packedRows;
+    vector<uint64_t> widePackedRows;
+
+private:
+    template <typename packed_type>
+    void walk(const string &transformedString, vector<packed_type> &rows, string &decodedString);
+
+public:
+    string decode(const string &transformedString);
+    void setWalkStarts(const vector<uint32_t> &starts) {
+        walkStarts = starts;
+    }
+};
+
+// Expands the bzip2-style RUNA/RUNB digits back into runs of zero ranks.
+class ZeroRunLengthCoder {
+public:
+    // Throws as soon as the ranks would grow longer than maxLength.
+    void decode(const vector<uint16_t> &symbols, string &ranks, size_t maxLength);
+};
+
+// The recency list is a flat 256-byte array, a symbol goes to the front with one memmove.
 class MoveToFrontTransformator {
+private:
+    unsigned char recency[ALPHABET_SIZE];
+
 public:
     string decode(const string &transformedString);
 
 };
 
-class HaffmanCoder {
+// Reads bits starting from the lowest bit of every byte, the counterpart of the compressor's BitWriter.
+// The 64-bit buffer is refilled a whole word at a time while at least eight bytes remain.
+class BitReader {
+private:
+    const unsigned char *data;
+    size_t size;
+    size_t position;
+    uint64_t buffer;
+    int bufferBits;
+
+public:
+    BitReader() : data(NULL), size(0), position(0), buffer(0), bufferBits(0) {
+    }
+    void reset(const char *bytes, size_t count) {
+        data = (const unsigned char *)bytes;
+        size = count;
+        position = 0;
+        buffer = 0;
+        bufferBits = 0;
+    }
+    // Leaves at least 57 bits in the buffer, past the end of data they are zeros.
+    void refill() {
+        if (position + 8 <= size) {
+            uint64_t word = 0;
+            for (int byte = 7; byte >= 0; --byte) {
+                word = (word << 8) | data[position + byte];
+            }
+            buffer |= word << bufferBits;
+            position += (63 - bufferBits) >> 3;
+            bufferBits |= 56;
+            return;
+        }
+        while (bufferBits <= 56) {
+            uint64_t byte = position < size ? data[position] : 0;
+            ++position;
+            buffer |= byte << bufferBits;
+            bufferBits += 8;
+        }
+    }
+    uint64_t peekBits(int count) const {
+        return buffer & ((1ull << count) - 1);
+    }
+    void skipBits(int count) {
+        buffer >>= count;
+        bufferBits -= count;
+    }
+    uint64_t readBits(int count) {
+        uint64_t bits = peekBits(count);
+        skipBits(count);
+        return bits;
+    }
+    uint64_t consumedBits() const {
+        return 8 * position - bufferBits;
+    }
+};
+
+// A symbol, or a link to the next level for codes longer than the current table.
+struct HaffmanTableEntry {
+    int symbol;
+    int length;
+    int subtable;
+    int subtableBits;
+};
+
+// Reads the table of one block with the coded bits and restores its symbols.
+class IEntropyCoder {
+public:
+    // A block of maxSymbols bytes never codes more symbols, counts above it are corrupted.
+    virtual void inputCodedData(istream &inputStream, uint64_t maxSymbols) = 0;
+    virtual void decode() = 0;
+    virtual const vector<uint16_t> &getDecodedText() = 0;
+    // for --stats: count of symbols used in the block and bits spent on them
+    virtual int distinctSymbols() = 0;
+    virtual uint64_t codedBits() = 0;
+    virtual ~IEntropyCoder() {
+    }
+};
+
+class HaffmanCoder : public IEntropyCoder {
 private:
     vector<char> decodeCodedText;
     int decodeCountSymbols;
-    int decodeCountBits;
-    
-    unordered_map<string, char> displayCodeToSymbol;
-    
-    string decodeDecodedText;
+    uint64_t decodeCountBits;
+    uint64_t decodeMaxSymbols;
+    BitReader bitReader;
+
+    // used symbols in the order canonical codes are given out: by code length, then by symbol
+    vector<uint16_t> sortedSymbols;
+    int lengthCount[HAFFMAN_MAX_CODE_LENGTH + 1];
+    vector<HaffmanTableEntry> decodeTable;
+    // longest code behind every entry of the first level that continues in a subtable
+    vector<int> subtableCodeLength;
+
+    vector<uint16_t> decodeDecodedText;
+
+private:
+    void buildDecodeTable();
 
 public:
-    void inputCodedData(istream &inputStream);
-    void decode();
-    string getDecodedText() {
+    virtual void inputCodedData(istream &inputStream, uint64_t maxSymbols);
+    virtual void decode();
+    virtual const vector<uint16_t> &getDecodedText() {
         return decodeDecodedText;
     }
+    virtual int distinctSymbols() {
+        return sortedSymbols.size();
+    }
+    virtual uint64_t codedBits() {
+        return decodeCountBits;
+    }
+};
+
+struct AnsTableEntry {
+    uint16_t symbol;
+    uint16_t bits;
+    uint32_t nextStateBase;
 };
 
+// Table-based asymmetric numeral system decoder (tANS, as in FSE): the state
+// gives the symbol directly, then takes a few raw bits to move to the next state.
+class AnsCoder : public IEntropyCoder {
+private:
+    vector<char> decodeCodedText;
+    int tableLog;
+    vector<int> normalizedCounts;
+    uint32_t decodeCountSymbols;
+    uint64_t decodeCountBits;
+    BitReader bitReader;
 
-void HaffmanCoder::inputCodedData(istream &inputStream) {
-    char symbol[2] = { ' ', '\0' };
-    decodeCountSymbols = readNumber(inputStream);
+    vector<AnsTableEntry> decodeTable;
+    vector<uint16_t> decodeDecodedText;
 
+private:
+    void makeDecodeTable();
+
+public:
+    virtual void inputCodedData(istream &inputStream, uint64_t maxSymbols);
+    virtual void decode();
+    virtual const vector<uint16_t> &getDecodedText() {
+        return decodeDecodedText;
+    }
+    virtual int distinctSymbols() {
+        return normalizedCounts.size() - count(normalizedCounts.begin(), normalizedCounts.end(), 0);
+    }
+    virtual uint64_t codedBits() {
+        return decodeCountBits;
+    }
+};
+
+
+// The coded bits are checked against what is left of the input before anything is allocated for them.
+void readCodedText(istream &inputStream, uint64_t countBits, vector<char> &codedText) {
+    streamsize available = inputStream.rdbuf()->in_avail();
+    if ((countBits + 7) / 8 > (uint64_t)std::max(available, (streamsize)0)) {
+        throw runtime_error("coded data is longer than the frame");
+    }
+    codedText.resize((countBits + 7) / 8);
+    inputStream.read(codedText.data(), codedText.size());
+}
+
+void HaffmanCoder::inputCodedData(istream &inputStream, uint64_t maxSymbols) {
+    decodeMaxSymbols = maxSymbols;
+    decodeCountSymbols = readUint(inputStream, 2);
+
+    if (decodeCountSymbols > ZERO_RUN_ALPHABET_SIZE) {
+        throw runtime_error("corrupted Haffman table");
+    }
+    char lengths[ZERO_RUN_ALPHABET_SIZE];
+    inputStream.read(lengths, decodeCountSymbols);
+    if (!inputStream) {
+        throw runtime_error("corrupted Haffman table");
+    }
+
+    fill(lengthCount, lengthCount + HAFFMAN_MAX_CODE_LENGTH + 1, 0);
     for (int i = 0; i < decodeCountSymbols; ++i) {
-        string codeForSymbol = readBinaryString(inputStream);
-        inputStream.read(symbol, C_SIZE);
-        displayCodeToSymbol.insert(make_pair(codeForSymbol, symbol[0]));
-        inputStream.read(symbol, C_SIZE);
+        int length = (unsigned char)lengths[i];
+        if (length > HAFFMAN_MAX_CODE_LENGTH) {
+            throw runtime_error("corrupted Haffman table");
+        }
+        ++lengthCount[length];
+    }
+    lengthCount[0] = 0;
+
+    // the same canonical order as in the compressor, symbols of a length keep their order
+    int lengthStart[HAFFMAN_MAX_CODE_LENGTH + 2] = { 0 };
+    for (int length = 1; length <= HAFFMAN_MAX_CODE_LENGTH; ++length) {
+        lengthStart[length + 1] = lengthStart[length] + lengthCount[length];
+    }
+    sortedSymbols.resize(lengthStart[HAFFMAN_MAX_CODE_LENGTH + 1]);
+    for (int i = 0; i < decodeCountSymbols; ++i) {
+        int length = (unsigned char)lengths[i];
+        if (length != 0) {
+            sortedSymbols[lengthStart[length]++] = i;
+        }
     }
-    
-    decodeCountBits = readNumber(inputStream);
-    
-    inputStream.read(symbol, C_SIZE);
-    while (!inputStream.eof()) {
-        decodeCodedText.push_back(symbol[0]);
-        inputStream.read(symbol, C_SIZE);
+
+    // more codes of some length than the shorter ones leave room for would overlap
+    uint64_t freeCodes = 1;
+    for (int length = 1; length <= HAFFMAN_MAX_CODE_LENGTH; ++length) {
+        freeCodes = 2 * freeCodes;
+        if ((uint64_t)lengthCount[length] > freeCodes) {
+            throw runtime_error("corrupted Haffman table");
+        }
+        freeCodes -= lengthCount[length];
     }
+
+    decodeCountBits = readUint(inputStream, 4);
+    readCodedText(inputStream, decodeCountBits, decodeCodedText);
 }
 
-void HaffmanCoder::decode() {
-    string prefix;
-    string bits;
-    char symbol[2] = { ' ', '\0' };
-
-    for (int bit = 0, symbolIndex = 0; bit < decodeCountBits; ++bit) {
-        if (bit % 8 == 0) {
-            char nextSymbol = decodeCodedText[symbolIndex];
-            bits.erase();
-            for (int i = 0; i < 8; ++i) {
-                if (nextSymbol % 2 == 0) {
-                    bits += "0";
+// The code written with its first bit lowest, as the bit reader sees it.
+uint32_t reverseBits(uint32_t code, int length) {
+    uint32_t reversed = 0;
+    for (int bit = 0; bit < length; ++bit) {
+        reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+    }
+    return reversed;
+}
+
+// Codes up to HAFFMAN_TABLE_BITS long fill every entry of the first level ending with them.
+// Longer codes sharing their first HAFFMAN_TABLE_BITS bits are contiguous in the canonical
+// order and resolve the rest of their bits in one subtable, with the maximum length of 20 two
+// levels are always enough. Codes are integers given out like in the compressor.
+void HaffmanCoder::buildDecodeTable() {
+    const int ROOT_SIZE = 1 << HAFFMAN_TABLE_BITS;
+    HaffmanTableEntry invalidEntry = { 0, 0, -1, 0 };
+    decodeTable.assign(ROOT_SIZE, invalidEntry);
+    subtableCodeLength.assign(ROOT_SIZE, 0);
+
+    uint32_t firstCode[HAFFMAN_MAX_CODE_LENGTH + 1] = { 0 };
+    for (int length = 1; length <= HAFFMAN_MAX_CODE_LENGTH; ++length) {
+        firstCode[length] = (firstCode[length - 1] + lengthCount[length - 1]) << 1;
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        size_t symbol = 0;
+        for (int length = 1; length <= HAFFMAN_MAX_CODE_LENGTH; ++length) {
+            for (uint32_t code = firstCode[length]; code < firstCode[length] + lengthCount[length]; ++code) {
+                int entrySymbol = sortedSymbols[symbol++];
+                if (length <= HAFFMAN_TABLE_BITS) {
+                    if (pass == 0) {
+                        for (int entry = reverseBits(code, length); entry < ROOT_SIZE; entry += 1 << length) {
+                            decodeTable[entry].symbol = entrySymbol;
+                            decodeTable[entry].length = length;
+                        }
+                    }
+                    continue;
                 }
-                else {
-                    bits += "1";
+
+                int restLength = length - HAFFMAN_TABLE_BITS;
+                int rootEntry = reverseBits(code >> restLength, HAFFMAN_TABLE_BITS);
+                if (pass == 0) {
+                    subtableCodeLength[rootEntry] = length;
+                    continue;
+                }
+                // the link is written through its index, growing the table moves the entries
+                if (decodeTable[rootEntry].subtable == -1) {
+                    int subtableBits = subtableCodeLength[rootEntry] - HAFFMAN_TABLE_BITS;
+                    decodeTable[rootEntry].length = HAFFMAN_TABLE_BITS;
+                    decodeTable[rootEntry].subtableBits = subtableBits;
+                    decodeTable[rootEntry].subtable = decodeTable.size();
+                    decodeTable.resize(decodeTable.size() + (1 << subtableBits), invalidEntry);
+                }
+                int subtable = decodeTable[rootEntry].subtable;
+                int subtableSize = 1 << decodeTable[rootEntry].subtableBits;
+                uint32_t rest = code & ((1u << restLength) - 1);
+                for (int entry = reverseBits(rest, restLength); entry < subtableSize; entry += 1 << restLength) {
+                    decodeTable[subtable + entry].symbol = entrySymbol;
+                    decodeTable[subtable + entry].length = restLength;
                 }
-                nextSymbol >>= 1;
             }
-            ++symbolIndex;
         }
+    }
+}
 
-        symbol[0] = bits[bit % 8];
-        prefix.append(symbol);
+void HaffmanCoder::decode() {
+    decodeDecodedText.clear();
+    buildDecodeTable();
+
+    // every code fits into the buffer after a refill: with blocks up to 64M codes are shorter than 40 bits
+    bitReader.reset(decodeCodedText.data(), decodeCodedText.size());
+    while (bitReader.consumedBits() < decodeCountBits) {
+        bitReader.refill();
 
-        if (displayCodeToSymbol.find(prefix) != displayCodeToSymbol.end()) {
-            symbol[0] = displayCodeToSymbol[prefix];
-            decodeDecodedText.append(symbol);
-            prefix.erase();
+        const HaffmanTableEntry *entry = &decodeTable[bitReader.peekBits(HAFFMAN_TABLE_BITS)];
+        while (entry->subtable != -1) {
+            bitReader.skipBits(entry->length);
+            entry = &decodeTable[entry->subtable + bitReader.peekBits(entry->subtableBits)];
+        }
+        if (entry->length == 0) {
+            throw runtime_error("corrupted Haffman code");
         }
+        if (decodeDecodedText.size() == decodeMaxSymbols) {
+            throw runtime_error("Haffman code holds more symbols than the block");
+        }
+        bitReader.skipBits(entry->length);
+        decodeDecodedText.push_back(entry->symbol);
     }
 }
 
 
-class Decompressor {
+int highestBit(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
+
+int readSmallNumber(istream &inputStream) {
+    int value = (unsigned char)inputStream.get();
+    if (value & 0x80) {
+        value = ((value & 0x7F) << 8) | (unsigned char)inputStream.get();
+    }
+    return value;
+}
+
+void AnsCoder::inputCodedData(istream &inputStream, uint64_t maxSymbols) {
+    tableLog = inputStream.get();
+    int symbolCount = readUint(inputStream, 2);
+    if (tableLog < 1 || tableLog > ANS_MAX_TABLE_LOG || symbolCount > ZERO_RUN_ALPHABET_SIZE) {
+        throw runtime_error("corrupted ANS table");
+    }
+
+    normalizedCounts.resize(symbolCount);
+    int total = 0;
+    for (int i = 0; i < symbolCount; ++i) {
+        normalizedCounts[i] = readSmallNumber(inputStream);
+        total += normalizedCounts[i];
+    }
+    if (total != (1 << tableLog) || !inputStream) {
+        throw runtime_error("corrupted ANS table");
+    }
+
+    decodeCountSymbols = readUint(inputStream, 4);
+    if (decodeCountSymbols > maxSymbols) {
+        throw runtime_error("ANS stream holds more symbols than the block");
+    }
+    decodeCountBits = readUint(inputStream, 4);
+    readCodedText(inputStream, decodeCountBits, decodeCodedText);
+}
+
+// The same spread as in the compressor. The k-th state of a symbol with count c moves
+// on to (c + k) << bits plus bits read, where bits bring the result back into the table.
+void AnsCoder::makeDecodeTable() {
+    const int TABLE_SIZE = 1 << tableLog;
+    const int STEP = (TABLE_SIZE >> 1) + (TABLE_SIZE >> 3) + 3;
+
+    decodeTable.resize(TABLE_SIZE);
+    int position = 0;
+    for (size_t symbol = 0; symbol < normalizedCounts.size(); ++symbol) {
+        for (int i = 0; i < normalizedCounts[symbol]; ++i) {
+            decodeTable[position].symbol = symbol;
+            position = (position + STEP) & (TABLE_SIZE - 1);
+        }
+    }
+
+    vector<int> nextCount(normalizedCounts);
+    for (int state = 0; state < TABLE_SIZE; ++state) {
+        AnsTableEntry &entry = decodeTable[state];
+        int count = nextCount[entry.symbol]++;
+        entry.bits = tableLog - highestBit(count);
+        entry.nextStateBase = (count << entry.bits) - TABLE_SIZE;
+    }
+}
+
+void AnsCoder::decode() {
+    makeDecodeTable();
+    decodeDecodedText.resize(decodeCountSymbols);
+
+    bitReader.reset(decodeCodedText.data(), decodeCodedText.size());
+    bitReader.refill();
+    uint32_t state = bitReader.readBits(tableLog);
+    for (uint32_t i = 0; i < decodeCountSymbols; ++i) {
+        bitReader.refill();
+        const AnsTableEntry &entry = decodeTable[state];
+        decodeDecodedText[i] = entry.symbol;
+        state = entry.nextStateBase + bitReader.readBits(entry.bits);
+    }
+    if (bitReader.consumedBits() != decodeCountBits) {
+        throw runtime_error("corrupted ANS stream");
+    }
+}
+
+
+// Restores one frame: Haffman -> MTF -> BWT, every worker thread owns its own.
+class BlockDecompressor {
 private:
     BarrowsWillerTransformator BWT;
     MoveToFrontTransformator MTFT;
+    ZeroRunLengthCoder zeroRunLengthCoder;
     HaffmanCoder haffmanCoder;
+    AnsCoder ansCoder;
+    IEntropyCoder *entropyCoder;
 
+    Crc32c crc32c;
+    uint32_t blockLength;
+    uint32_t blockChecksum;
+    int frameFlags;
+    int entropyCoderId;
+    string transformedText;
     string decompressedText;
+    BlockStats stats;
+    chrono::steady_clock::time_point stageStart;
 
 private:
-    void initialize(istream &inputStream) {
-        int index = readNumber(inputStream);
-        char symbol[2] = { ' ', '\0' };
+    void startStage() {
+        peakHeapBytes = liveHeapBytes.load();
+        stageStart = chrono::steady_clock::now();
+    }
+    // the heap peak is exact with one thread, with several it is the peak of the whole process
+    void finishStage(DecompressionStage stage, uint64_t bytesIn, uint64_t bytesOut) {
+        StageStats &stageStats = stats.stages[stage];
+        stageStats.seconds = chrono::duration<double>(chrono::steady_clock::now() - stageStart).count();
+        stageStats.bytesIn = bytesIn;
+        stageStats.bytesOut = bytesOut;
+        stageStats.peakHeapBytes = peakHeapBytes.load();
+    }
+    void inputFrame(istream &inputStream) {
+        blockLength = readUint(inputStream, 4);
+        if (blockLength > MAX_BLOCK_LENGTH) {
+            throw runtime_error("block length in the frame header is over the limit");
+        }
+        blockChecksum = readUint(inputStream, 4);
+        vector<uint32_t> walkStarts(1, readUint(inputStream, 4));
+        int walks = inputStream.get();
+        if (walks < 0 || walks > BWT_MAX_WALKS || (uint32_t)walks > blockLength || (walks == 0 && blockLength > 0)) {
+            throw runtime_error("corrupted BWT walk starts");
+        }
+        for (int i = 1; i < walks; ++i) {
+            walkStarts.push_back(readUint(inputStream, 4));
+        }
+        frameFlags = inputStream.get();
+        entropyCoderId = inputStream.get();
+        if (entropyCoderId == ENTROPY_HAFFMAN) {
+            entropyCoder = &haffmanCoder;
+        }
+        else if (entropyCoderId == ENTROPY_ANS) {
+            entropyCoder = &ansCoder;
+        }
+        else {
+            throw runtime_error("unknown entropy coder in the frame header");
+        }
 
-        BWT.setInitialStringIndex(index);
-        haffmanCoder.inputCodedData(inputStream);
+        BWT.setWalkStarts(walkStarts);
+        stats.primaryIndex = walkStarts[0];
     }
-    void actuallyDecompression() {
-        haffmanCoder.decode();
-        string decodedString = haffmanCoder.getDecodedText();
-        string decodedFromMTFTString = MTFT.decode(decodedString);
-        decompressedText = BWT.decode(decodedFromMTFTString, BWT.getInitialStringIndex());
+    // Undoes the entropy coder, zero runs and MTF, which leaves the BWT of the block.
+    void decodeTransformedText(istream &inputStream) {
+        startStage();
+        streampos codedDataStart = inputStream.tellg();
+        entropyCoder->inputCodedData(inputStream, blockLength);
+        uint64_t codedDataSize = inputStream.tellg() - codedDataStart;
+        entropyCoder->decode();
+        const vector<uint16_t> &decodedSymbols = entropyCoder->getDecodedText();
+        const uint64_t SYMBOLS_SIZE = decodedSymbols.size() * sizeof(uint16_t);
+        finishStage(STAGE_ENTROPY, codedDataSize, SYMBOLS_SIZE);
+        stats.distinctSymbols = entropyCoder->distinctSymbols();
+        stats.averageCodeLength = decodedSymbols.empty() ? 0.0 : (double)entropyCoder->codedBits() / decodedSymbols.size();
+        stats.entropyCoderId = entropyCoderId;
+
+        startStage();
+        string decodedString;
+        if (frameFlags & FRAME_FLAG_ZERO_RUNS) {
+            zeroRunLengthCoder.decode(decodedSymbols, decodedString, blockLength);
+        }
+        else {
+            decodedString.resize(decodedSymbols.size());
+            for (size_t i = 0; i < decodedSymbols.size(); ++i) {
+                decodedString[i] = (char)decodedSymbols[i];
+            }
+        }
+        if (decodedString.size() != blockLength) {
+            throw runtime_error("decoded block length does not match the frame header");
+        }
+        finishStage(STAGE_ZERO_RUNS, SYMBOLS_SIZE, blockLength);
+
+        startStage();
+        transformedText = MTFT.decode(decodedString);
+        string().swap(decodedString);
+        finishStage(STAGE_MTF, blockLength, blockLength);
     }
-    void outputData(ostream& outputStream) {
-        outputStream << decompressedText << '\n';
+    void actuallyDecompression(istream &inputStream) {
+        decodeTransformedText(inputStream);
+
+        startStage();
+        decompressedText = BWT.decode(transformedText);
+        string().swap(transformedText);
+        finishStage(STAGE_BWT, blockLength, blockLength);
+
+        uint32_t checksum = crc32c.compute(decompressedText.data(), decompressedText.size());
+        if (checksum != blockChecksum) {
+            ostringstream message;
+            message << "checksum mismatch: stored " << hex << blockChecksum << ", restored data has " << checksum;
+            throw runtime_error(message.str());
+        }
     }
 
 public:
-    void decompress(string inputFile, string outputFile);
-
+    const string &decompressFrame(istream &inputStream) {
+        inputFrame(inputStream);
+        actuallyDecompression(inputStream);
+        return decompressedText;
+    }
+    // Decodes a frame only up to its BWT, the checksum is left to whoever restores the block.
+    const string &decodeTransformedFrame(istream &inputStream) {
+        inputFrame(inputStream);
+        decodeTransformedText(inputStream);
+        return transformedText;
+    }
+    uint32_t getBlockChecksum() const {
+        return blockChecksum;
+    }
+    const BlockStats &getStats() const {
+        return stats;
+    }
 };
 
+class Decompressor {
+private:
+    const char *archiveData;
+    size_t archiveSize;
+    vector<FrameIndexEntry> frameIndex;
+    vector<uint64_t> outputOffsets;
+    vector<BlockStats> blockStats;
+    // restored offsets of the records of a batch and the end of the last one, empty otherwise
+    vector<uint64_t> recordOffsets;
+
+    mutex outputMutex;
+    condition_variable frameWritten;
+    size_t nextFrame;
+    size_t nextWrittenFrame;
+    // the first error of a worker, the others stop and it is rethrown after they finish
+    exception_ptr workerError;
 
-string BarrowsWillerTransformator::decode(const string &transformedString, int initialStringIndex) {
-    const int SIZE = transformedString.size();
+    // the frame last decoded by read, kept for the reads that follow it
+    BlockDecompressor rangeDecompressor;
+    size_t rangeFrame;
+    const string *rangeText;
 
-    vector<int> countSymbol(ALPHABET_SIZE);
-    vector<int> cummulateSumCountSymbol(ALPHABET_SIZE);
-    vector<int> countEarlierSameSymbol(SIZE);
-    vector<int> reverseTransfer(SIZE);
-    vector<int> transfer(SIZE);
+private:
+    void readFrameIndex(istream &inputStream);
+    void readRecordTable(istream &inputStream, uint64_t indexOffset);
+    void checkRecord(uint64_t record) const;
+    void decompressSequentially(IOutputSink &output);
+    void decompressInParallel(IOutputSink &output, int threads);
+    void workerLoop(IOutputSink &output);
 
-    for (int i = 0; i < SIZE; ++i) {
-        int index = symbolToIndex[transformedString[i]];
-        countEarlierSameSymbol[i] = countSymbol[index];
-        ++countSymbol[index];
+public:
+    Decompressor() : archiveData(NULL), archiveSize(0), rangeFrame(0), rangeText(NULL) {
+    }
+    // File to file, "-" stands for the standard streams.
+    void decompress(string inputFile, string outputFile, const DecompressionOptions &options);
+    // Reads the frame index of an archive in memory, the caller keeps it alive while decompressing.
+    void openArchive(const char *data, size_t size);
+    // Restored size of the opened archive.
+    uint64_t getDecompressedSize() const {
+        return outputOffsets.empty() ? 0 : outputOffsets.back();
     }
-    for (int i = 1; i < ALPHABET_SIZE; ++i) {
-        cummulateSumCountSymbol[i] = cummulateSumCountSymbol[i - 1] + countSymbol[i - 1];
+    // Restores the opened archive into the output.
+    void decompress(IOutputSink &output, const DecompressionOptions &options);
+    // Copies length bytes from the given offset of the restored data, decoding only the frames
+    // they lie in. Returns how many were copied, fewer at the end of the data.
+    size_t read(uint64_t offset, char *buffer, size_t length);
+    // Records of an archive written by RecordBatchCompressor, zero for other archives.
+    uint64_t getRecordCount() const {
+        return recordOffsets.empty() ? 0 : recordOffsets.size() - 1;
     }
-    for (int i = 0; i < SIZE; ++i) {
-        int index = symbolToIndex[transformedString[i]];
-        reverseTransfer[i] = cummulateSumCountSymbol[index] + countEarlierSameSymbol[i];
-        transfer[reverseTransfer[i]] = i;
+    // Restores one record, decoding only the frames it lies in.
+    void readRecord(uint64_t record, string &output);
+    size_t getFrameCount() const {
+        return frameIndex.size();
+    }
+    const FrameIndexEntry &getFrameEntry(size_t frame) const {
+        return frameIndex[frame];
+    }
+    // Offset of the frame's block in the restored data.
+    uint64_t getFrameOutputOffset(size_t frame) const {
+        return outputOffsets[frame];
+    }
+    // Decodes one frame of the opened archive, the text lives until the block decompressor takes the next frame.
+    const string &decompressFrame(BlockDecompressor &blockDecompressor, istream &inputStream, size_t frame);
+    // Stats of every frame in the archive order.
+    const vector<BlockStats> &getBlockStats() const {
+        return blockStats;
     }
 
-    string sortedString;
-    char symbol[2] = { ' ', '\0' };
-    for (int i = 0; i < ALPHABET_SIZE; ++i) {
-        symbol[0] = ALLOWED_SYMBOLS[i];
-        for (int j = 0; j < countSymbol[i]; ++j) {
-            sortedString.append(symbol);
-        }
+};
+
+
+// packed row: (index of the next row << 8) | first symbol of the row
+template <typename packed_type>
+void BarrowsWillerTransformator::walk(const string &transformedString, vector<packed_type> &rows,
+                                      string &decodedString) {
+    const size_t SIZE = transformedString.size();
+    const int WALKS = walkStarts.size();
+
+    size_t symbolStart[ALPHABET_SIZE] = { 0 };
+    for (size_t i = 0; i < SIZE; ++i) {
+        ++symbolStart[(unsigned char)transformedString[i]];
+    }
+    for (size_t symbol = 0, sum = 0; symbol < ALPHABET_SIZE; ++symbol) {
+        size_t count = symbolStart[symbol];
+        symbolStart[symbol] = sum;
+        sum += count;
+    }
+    // the j-th occurrence of a symbol in the last column is its j-th occurrence in the first one
+    rows.resize(SIZE);
+    for (size_t i = 0; i < SIZE; ++i) {
+        unsigned char symbol = transformedString[i];
+        rows[symbolStart[symbol]++] = ((packed_type)i << 8) | symbol;
     }
 
-    string decodedString;
-    int nextIndex = initialStringIndex;
-    for (int i = 0; i < SIZE; ++i) {
-        symbol[0] = sortedString[nextIndex];
-        nextIndex = transfer[nextIndex];
-        decodedString.append(symbol);
+    // walk k restores [k * SIZE / WALKS, (k + 1) * SIZE / WALKS)
+    packed_type row[BWT_MAX_WALKS];
+    char *output[BWT_MAX_WALKS];
+    size_t minLength = SIZE;
+    for (int k = 0; k < WALKS; ++k) {
+        if (walkStarts[k] >= SIZE) {
+            throw runtime_error("corrupted BWT walk starts");
+        }
+        row[k] = walkStarts[k];
+        output[k] = &decodedString[k * SIZE / WALKS];
+        minLength = std::min(minLength, (k + 1) * SIZE / WALKS - k * SIZE / WALKS);
     }
+    for (size_t step = 0; step < minLength; ++step) {
+        for (int k = 0; k < WALKS; ++k) {
+            packed_type entry = rows[row[k]];
+            output[k][step] = (char)entry;
+            row[k] = entry >> 8;
+        }
+    }
+    for (int k = 0; k < WALKS; ++k) {
+        size_t length = (k + 1) * SIZE / WALKS - k * SIZE / WALKS;
+        for (size_t step = minLength; step < length; ++step) {
+            packed_type entry = rows[row[k]];
+            output[k][step] = (char)entry;
+            row[k] = entry >> 8;
+        }
+    }
+}
 
+string BarrowsWillerTransformator::decode(const string &transformedString) {
+    string decodedString(transformedString.size(), '\0');
+    if (transformedString.size() < (1u << 24)) {
+        walk(transformedString, packedRows, decodedString);
+    }
+    else {
+        walk(transformedString, widePackedRows, decodedString);
+    }
     return decodedString;
 }
 
+void ZeroRunLengthCoder::decode(const vector<uint16_t> &symbols, string &ranks, size_t maxLength) {
+    ranks.clear();
+    size_t runLength = 0, digitWeight = 1;
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        int symbol = symbols[i];
+        if (symbol == RUN_A || symbol == RUN_B) {
+            // checked before the weight can overflow: it passes maxLength first
+            runLength += (symbol == RUN_A ? 1 : 2) * digitWeight;
+            digitWeight <<= 1;
+            if (runLength > maxLength - ranks.size()) {
+                throw runtime_error("zero runs are longer than the block");
+            }
+            continue;
+        }
+        if (runLength + 1 > maxLength - ranks.size()) {
+            throw runtime_error("zero runs are longer than the block");
+        }
+        ranks.append(runLength, '\0');
+        runLength = 0;
+        digitWeight = 1;
+        ranks.push_back((char)(symbol - 1));
+    }
+    ranks.append(runLength, '\0');
+}
+
 string MoveToFrontTransformator::decode(const string &transformedString) {
-    deque<int> encode;
     for (int i = 0; i < ALPHABET_SIZE; ++i) {
-        encode.push_back(i);
+        recency[i] = (unsigned char)i;
     }
-    string decodedString;
-    char symbol[2] = { ' ', '\0' };
+    string decodedString(transformedString.size(), '\0');
+    char *output = &decodedString[0];
 
-    for (int i = 0; i < transformedString.size(); ++i) {
-        int codePoint = symbolToIndex[transformedString[i]];
-        int index = encode[codePoint];
-        char oneSymbol = ALLOWED_SYMBOLS[index];
-        symbol[0] = oneSymbol;
-        decodedString.append(symbol);
-        encode.erase(encode.begin() + codePoint);
-        encode.push_front(index);
+    for (size_t i = 0; i < transformedString.size(); ++i) {
+        int rank = (unsigned char)transformedString[i];
+        unsigned char symbol = recency[rank];
+        memmove(recency + 1, recency, rank);
+        recency[0] = symbol;
+        output[i] = (char)symbol;
     }
     return decodedString;
 }
 
 
-void initialize() {
-    for (int index = 0; index < ALPHABET_SIZE; ++index) {
-        char symbol = ALLOWED_SYMBOLS[index];
-        symbolToIndex.insert(make_pair(symbol, index));
+void InputFile::open(const string &path) {
+    close();
+    int descriptor = STDIN_FILENO;
+    if (path != "-") {
+        descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            throw runtime_error("cannot open " + path + ": " + strerror(errno));
+        }
+    }
+
+    struct stat fileStatus;
+    if (fstat(descriptor, &fileStatus) == 0 && S_ISREG(fileStatus.st_mode) && fileStatus.st_size > 0) {
+        void *address = mmap(NULL, fileStatus.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (address != MAP_FAILED) {
+            mapped = (const char *)address;
+            mappedSize = fileStatus.st_size;
+        }
+    }
+    while (mapped == NULL) {
+        const size_t CHUNK_SIZE = 1 << 20;
+        size_t size = buffer.size();
+        buffer.resize(size + CHUNK_SIZE);
+        ssize_t count = read(descriptor, buffer.data() + size, CHUNK_SIZE);
+        buffer.resize(size + std::max(count, (ssize_t)0));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            string reason = strerror(errno);
+            if (descriptor != STDIN_FILENO) {
+                ::close(descriptor);
+            }
+            throw runtime_error("cannot read " + path + ": " + reason);
+        }
+        if (count == 0) {
+            break;
+        }
+    }
+    if (descriptor != STDIN_FILENO) {
+        ::close(descriptor);
+    }
+}
+
+void InputFile::close() {
+    if (mapped != NULL) {
+        munmap((void *)mapped, mappedSize);
+    }
+    mapped = NULL;
+    mappedSize = 0;
+    buffer.clear();
+}
+
+uint64_t readUint(istream &inputStream, int bytes) {
+    unsigned char buffer[8] = { 0 };
+    inputStream.read((char *)buffer, bytes);
+
+    uint64_t value = 0;
+    for (int byte = bytes - 1; byte >= 0; --byte) {
+        value = (value << 8) | buffer[byte];
     }
+    return value;
 }
 
-string readData(istream& inputStream) {
-    string data;
-    char symbol[2] = { ' ', '\0' };
+void Decompressor::readFrameIndex(istream &inputStream) {
+    inputStream.seekg(0, std::ios::end);
+    uint64_t fileSize = inputStream.tellg();
+    if (!inputStream || fileSize < ARCHIVE_TRAILER_SIZE) {
+        throw runtime_error("archive is too short to hold a frame index");
+    }
 
-    while (!inputStream.eof()) {
-        inputStream.read(symbol, C_SIZE);
-        if (symbol[0] == '\r' || symbol[0] == '\n') {
-            break;
+    inputStream.seekg(fileSize - ARCHIVE_TRAILER_SIZE);
+    uint64_t frameCount = readUint(inputStream, 8);
+    uint64_t indexOffset = readUint(inputStream, 8);
+    string magic(ARCHIVE_MAGIC.size(), ' ');
+    inputStream.read(&magic[0], magic.size());
+    if ((magic != ARCHIVE_MAGIC && magic != FM_INDEXED_ARCHIVE_MAGIC)
+        || indexOffset + 24 * frameCount + ARCHIVE_TRAILER_SIZE != fileSize) {
+        throw runtime_error("archive has no valid frame index");
+    }
+
+    inputStream.seekg(indexOffset);
+    frameIndex.resize(frameCount);
+    outputOffsets.resize(frameCount + 1);
+    blockStats.resize(frameCount);
+    for (uint64_t i = 0; i < frameCount; ++i) {
+        frameIndex[i].offset = readUint(inputStream, 8);
+        frameIndex[i].size = readUint(inputStream, 8);
+        frameIndex[i].blockLength = readUint(inputStream, 8);
+        if (frameIndex[i].offset > indexOffset || frameIndex[i].size > indexOffset - frameIndex[i].offset) {
+            ostringstream message;
+            message << "frame index points block " << i << " outside the archive";
+            throw runtime_error(message.str());
+        }
+        outputOffsets[i + 1] = outputOffsets[i] + frameIndex[i].blockLength;
+    }
+    readRecordTable(inputStream, indexOffset);
+}
+
+// The table is there if its trailer ends right at the index and all frames end before it.
+void Decompressor::readRecordTable(istream &inputStream, uint64_t indexOffset) {
+    recordOffsets.clear();
+    uint64_t framesEnd = 0;
+    for (size_t i = 0; i < frameIndex.size(); ++i) {
+        framesEnd = std::max(framesEnd, frameIndex[i].offset + frameIndex[i].size);
+    }
+    if (indexOffset < framesEnd + RECORD_TABLE_TRAILER_SIZE) {
+        return;
+    }
+    inputStream.seekg(indexOffset - RECORD_TABLE_TRAILER_SIZE);
+    uint64_t recordCount = readUint(inputStream, 8);
+    uint64_t tableOffset = readUint(inputStream, 8);
+    string magic(RECORD_TABLE_MAGIC.size(), ' ');
+    inputStream.read(&magic[0], magic.size());
+    if (!inputStream || magic != RECORD_TABLE_MAGIC) {
+        return;
+    }
+    uint64_t tableEnd = indexOffset - RECORD_TABLE_TRAILER_SIZE;
+    if (tableOffset < framesEnd || tableOffset > tableEnd || recordCount > tableEnd - tableOffset) {
+        throw runtime_error("archive has a corrupted record table");
+    }
+
+    inputStream.seekg(tableOffset);
+    recordOffsets.resize(recordCount + 1);
+    for (uint64_t i = 0; i < recordCount; ++i) {
+        uint64_t length = 0;
+        for (int shift = 0; ; shift += 7) {
+            int byte = inputStream.get();
+            if (byte < 0 || shift > 56) {
+                throw runtime_error("archive has a corrupted record table");
+            }
+            length |= (uint64_t)(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                break;
+            }
         }
-        symbol[0] = ' ';
-        data.append(symbol);
+        recordOffsets[i + 1] = recordOffsets[i] + length;
+    }
+    if ((uint64_t)inputStream.tellg() != tableEnd || recordOffsets.back() != getDecompressedSize()) {
+        throw runtime_error("record table does not match the frames");
     }
-    return data;
 }
 
-string readBinaryString(istream &inputStream) {
-    string codeString;
-    char codeSymbol[2] = { ' ', '\0' };
-    inputStream.read(codeSymbol, C_SIZE);
+// Decodes a frame and checks it against the index, errors name the block they come from.
+const string &Decompressor::decompressFrame(BlockDecompressor &blockDecompressor, istream &inputStream,
+                                            size_t frame) {
+    const FrameIndexEntry &entry = frameIndex[frame];
+    try {
+        inputStream.seekg(entry.offset);
+        const string &decompressedText = blockDecompressor.decompressFrame(inputStream);
+        if (!inputStream || (uint64_t)inputStream.tellg() != entry.offset + entry.size) {
+            throw runtime_error("frame is truncated or does not end where the index says");
+        }
+        if (decompressedText.size() != entry.blockLength) {
+            throw runtime_error("block length does not match the index");
+        }
+        blockStats[frame] = blockDecompressor.getStats();
+        return decompressedText;
+    }
+    catch (const exception &error) {
+        ostringstream message;
+        message << "block " << frame << " at archive offset " << entry.offset << ": " << error.what();
+        throw runtime_error(message.str());
+    }
+}
 
-    while (codeSymbol[0] == '0' || codeSymbol[0] == '1') {
-        codeString.append(codeSymbol);
-        inputStream.read(codeSymbol, C_SIZE);
+void Decompressor::decompressSequentially(IOutputSink &output) {
+    MemoryInputBuffer archiveBuffer(archiveData, archiveSize);
+    istream compressedInputStream(&archiveBuffer);
+    BlockDecompressor blockDecompressor;
+    for (size_t i = 0; i < frameIndex.size(); ++i) {
+        const string &decompressedText = decompressFrame(blockDecompressor, compressedInputStream, i);
+        output.write(decompressedText.data(), decompressedText.size());
     }
-    return codeString;
 }
 
-int readNumber(istream &inputStream) {
-    int number = 0;
-    char numberSymbol[2] = { ' ', '\0' };
-    inputStream.read(numberSymbol, C_SIZE);
+void Decompressor::workerLoop(IOutputSink &output) {
+    MemoryInputBuffer archiveBuffer(archiveData, archiveSize);
+    istream compressedInputStream(&archiveBuffer);
+    BlockDecompressor blockDecompressor;
+
+    while (true) {
+        size_t frame;
+        {
+            lock_guard<mutex> lock(outputMutex);
+            frame = nextFrame++;
+        }
+        if (frame >= frameIndex.size()) {
+            return;
+        }
+
+        try {
+            const string &decompressedText = decompressFrame(blockDecompressor, compressedInputStream, frame);
+            if (output.isSeekable()) {
+                output.writeAt(outputOffsets[frame], decompressedText.data(), decompressedText.size());
+                continue;
+            }
+            // a pipe takes frames only in order, the worker with the earliest frame never waits
+            unique_lock<mutex> lock(outputMutex);
+            frameWritten.wait(lock, [this, frame] { return nextWrittenFrame == frame || workerError; });
+            if (workerError) {
+                return;
+            }
+            output.write(decompressedText.data(), decompressedText.size());
+            ++nextWrittenFrame;
+            frameWritten.notify_all();
+        }
+        catch (...) {
+            lock_guard<mutex> lock(outputMutex);
+            if (!workerError) {
+                workerError = current_exception();
+            }
+            nextFrame = frameIndex.size();
+            frameWritten.notify_all();
+            return;
+        }
+    }
+}
 
-    while (numberSymbol[0] >= '0' && numberSymbol[0] <= '9') {
-        number *= 10;
-        number += (int)(numberSymbol[0] - '0');
-        inputStream.read(numberSymbol, C_SIZE);
+// Frames are independent and their output offsets are known from the index,
+// so every worker decodes whole frames and writes them straight into place.
+void Decompressor::decompressInParallel(IOutputSink &output, int threads) {
+    nextFrame = 0;
+    nextWrittenFrame = 0;
+    workerError = exception_ptr();
+    vector<thread> workers;
+    for (int i = 0; i < threads; ++i) {
+        workers.push_back(thread(&Decompressor::workerLoop, this, std::ref(output)));
+    }
+    for (int i = 0; i < threads; ++i) {
+        workers[i].join();
+    }
+    if (workerError) {
+        rethrow_exception(workerError);
     }
-    return number;
 }
 
-void Decompressor::decompress(string inputFile, string outputFile) {
-    ifstream compressedInputStream(inputFile, std::ios::binary | std::ios::in);
-    ofstream decompressedOutputStream(outputFile, std::ios::binary | std::ios::out);
+void Decompressor::decompress(string inputFile, string outputFile, const DecompressionOptions &options) {
+    InputFile archive;
+    archive.open(inputFile);
+    openArchive(archive.data(), archive.size());
+
+    uint64_t offset = options.rangeOffset;
+    uint64_t end = offset + std::min(options.rangeLength, UINT64_MAX - offset);
+    if (options.record >= 0) {
+        checkRecord(options.record);
+        offset = recordOffsets[options.record];
+        end = recordOffsets[options.record + 1];
+    }
 
-    initialize(compressedInputStream);
-    actuallyDecompression();
-    outputData(decompressedOutputStream);
+    OutputFileBuffer decompressedOutputBuffer;
+    decompressedOutputBuffer.open(outputFile);
+    OutputFileSink decompressedOutput(decompressedOutputBuffer);
+    if (options.range || options.record >= 0) {
+        vector<char> buffer(1 << 20);
+        while (offset < end) {
+            size_t count = read(offset, buffer.data(), std::min<uint64_t>(buffer.size(), end - offset));
+            if (count == 0) {
+                break;
+            }
+            decompressedOutput.write(buffer.data(), count);
+            offset += count;
+        }
+    }
+    else {
+        decompress(decompressedOutput, options);
+    }
+    decompressedOutputBuffer.close();
 }
 
+void Decompressor::openArchive(const char *data, size_t size) {
+    archiveData = data;
+    archiveSize = size;
+    rangeText = NULL;
+    MemoryInputBuffer archiveBuffer(data, size);
+    istream compressedInputStream(&archiveBuffer);
+    readFrameIndex(compressedInputStream);
+}
 
-int main() {
-    initialize();
+void Decompressor::decompress(IOutputSink &output, const DecompressionOptions &options) {
+    checkOptions(options);
+    if (options.threads > 1 && frameIndex.size() > 1) {
+        decompressInParallel(output, options.threads);
+    }
+    else {
+        decompressSequentially(output);
+    }
+}
+
+// Hands the restored data out in chunks of the caller's size. A frame is decoded only when
+// the previous one is used up, so reading the start of an archive costs just its first frames
+// and only one block is held at a time.
+class DecompressionStream {
+private:
+    InputFile archiveFile;
     Decompressor decompressor;
-    decompressor.decompress("input.txt", "output.txt");
+    MemoryInputBuffer archiveBuffer;
+    istream compressedInputStream;
+    BlockDecompressor blockDecompressor;
+    size_t nextFrame;
+    const string *block;
+    size_t blockPosition;
+
+public:
+    DecompressionStream() : compressedInputStream(&archiveBuffer), nextFrame(0), block(NULL), blockPosition(0) {
+    }
+    // "-" stands for the standard input.
+    void open(const string &path);
+    // The caller keeps the archive alive while reading.
+    void open(const char *data, size_t size);
+    // Copies at most size bytes into buffer, returns 0 once the archive is over.
+    size_t read(char *buffer, size_t size);
+    uint64_t getDecompressedSize() const {
+        return decompressor.getDecompressedSize();
+    }
+};
+
+void DecompressionStream::open(const string &path) {
+    archiveFile.open(path);
+    open(archiveFile.data(), archiveFile.size());
+}
+
+void DecompressionStream::open(const char *data, size_t size) {
+    decompressor.openArchive(data, size);
+    archiveBuffer.open(data, size);
+    compressedInputStream.clear();
+    nextFrame = 0;
+    block = NULL;
+    blockPosition = 0;
+}
+
+size_t DecompressionStream::read(char *buffer, size_t size) {
+    size_t copied = 0;
+    while (copied < size) {
+        if (block == NULL || blockPosition == block->size()) {
+            if (nextFrame == decompressor.getFrameCount()) {
+                break;
+            }
+            block = &decompressor.decompressFrame(blockDecompressor, compressedInputStream, nextFrame++);
+            blockPosition = 0;
+            continue;
+        }
+        size_t count = std::min(size - copied, block->size() - blockPosition);
+        memcpy(buffer + copied, block->data() + blockPosition, count);
+        copied += count;
+        blockPosition += count;
+    }
+    return copied;
+}
+
+// The index gives the restored offset of every frame, the frame holding the offset
+// is the last one starting at or before it.
+size_t Decompressor::read(uint64_t offset, char *buffer, size_t length) {
+    if (offset >= getDecompressedSize()) {
+        return 0;
+    }
+    length = std::min<uint64_t>(length, getDecompressedSize() - offset);
+    MemoryInputBuffer archiveBuffer(archiveData, archiveSize);
+    istream compressedInputStream(&archiveBuffer);
+    size_t frame = upper_bound(outputOffsets.begin(), outputOffsets.end(), offset) - outputOffsets.begin() - 1;
+    size_t copied = 0;
+    for (; copied < length; ++frame) {
+        if (rangeText == NULL || rangeFrame != frame) {
+            rangeText = NULL;
+            rangeText = &decompressFrame(rangeDecompressor, compressedInputStream, frame);
+            rangeFrame = frame;
+        }
+        uint64_t blockOffset = offset + copied - outputOffsets[frame];
+        size_t count = std::min<uint64_t>(length - copied, rangeText->size() - blockOffset);
+        memcpy(buffer + copied, rangeText->data() + blockOffset, count);
+        copied += count;
+    }
+    return copied;
+}
+
+void Decompressor::checkRecord(uint64_t record) const {
+    if (record >= getRecordCount()) {
+        ostringstream message;
+        message << "archive has " << getRecordCount() << " records, no record " << record;
+        throw runtime_error(message.str());
+    }
+}
+
+void Decompressor::readRecord(uint64_t record, string &output) {
+    checkRecord(record);
+    output.resize(recordOffsets[record + 1] - recordOffsets[record]);
+    if (!output.empty()) {
+        read(recordOffsets[record], &output[0], output.size());
+    }
+}
+
+// Replaces the contents of output with the data restored from the archive of size bytes at data.
+// Every call works on its own state, so any number of them may run at once.
+void decompressBuffer(const uint8_t *data, size_t size, vector<uint8_t> &output,
+                      const DecompressionOptions &options = DecompressionOptions()) {
+    Decompressor decompressor;
+    decompressor.openArchive((const char *)data, size);
+    uint64_t decompressedSize = decompressor.getDecompressedSize();
+    if (decompressedSize > output.max_size()) {
+        throw runtime_error("archive restores to more than fits in memory");
+    }
+    output.resize(decompressedSize);
+    MemoryOutput memoryOutput((char *)output.data(), output.size());
+    decompressor.decompress(memoryOutput, options);
+}
+
+// The same into a buffer of the given capacity, returns the restored size.
+size_t decompressBuffer(const uint8_t *data, size_t size, uint8_t *output, size_t capacity,
+                        const DecompressionOptions &options = DecompressionOptions()) {
+    Decompressor decompressor;
+    decompressor.openArchive((const char *)data, size);
+    uint64_t decompressedSize = decompressor.getDecompressedSize();
+    if (decompressedSize > capacity) {
+        ostringstream message;
+        message << "output buffer is too small, the archive restores to " << decompressedSize << " bytes";
+        throw runtime_error(message.str());
+    }
+    MemoryOutput memoryOutput((char *)output, capacity);
+    decompressor.decompress(memoryOutput, options);
+    return decompressedSize;
+}
+
+// benchmark.cpp includes this file with COMPRESSIT_NO_MAIN and brings its own main.
+#ifndef COMPRESSIT_NO_MAIN
+int main(int argc, char *argv[]) {
+    DecompressionOptions options;
+    vector<string> paths;
+    for (int i = 1; i < argc; ++i) {
+        string argument = argv[i];
+        if (argument == "-" || argument[0] != '-') {
+            paths.push_back(argument);
+        }
+        else if (argument == "--threads" && i + 1 < argc) {
+            options.threads = atoi(argv[++i]);
+            if (options.threads == 0) {
+                options.threads = std::max(1u, thread::hardware_concurrency());
+            }
+        }
+        else if (argument == "--stats" && i + 1 < argc) {
+            options.statsFormat = argv[++i];
+        }
+        else if (argument == "--record" && i + 1 < argc) {
+            options.record = atoll(argv[++i]);
+        }
+        else if (argument == "--range" && i + 1 < argc) {
+            const char *offsetStart = argv[++i];
+            char *end;
+            options.rangeOffset = strtoull(offsetStart, &end, 10);
+            bool valid = end != offsetStart && *end == ':';
+            if (valid) {
+                const char *lengthStart = end + 1;
+                options.rangeLength = strtoull(lengthStart, &end, 10);
+                valid = end != lengthStart && *end == '\0';
+            }
+            if (!valid) {
+                cerr << "range must look like OFFSET:LENGTH" << endl;
+                return 1;
+            }
+            options.range = true;
+        }
+        else {
+            cerr << "usage: " << argv[0] << " [--threads N] [--stats json] [--range OFFSET:LENGTH] [--record N]"
+                 << " [INPUT [OUTPUT]]"
+                 << endl;
+            return 1;
+        }
+    }
+    if (paths.size() > 2) {
+        cerr << "expected at most an input and an output path, \"-\" for the standard streams" << endl;
+        return 1;
+    }
+    try {
+        checkOptions(options);
+    }
+    catch (const exception &error) {
+        cerr << error.what() << endl;
+        return 1;
+    }
+
+    string inputFile = paths.size() > 0 ? paths[0] : "input.txt";
+    string outputFile = paths.size() > 1 ? paths[1] : "output.txt";
+
+    Decompressor decompressor;
+    try {
+        decompressor.decompress(inputFile, outputFile, options);
+    }
+    catch (const exception &error) {
+        cerr << error.what() << endl;
+        return 1;
+    }
+    if (options.statsFormat == "json") {
+        printStatsJson(cerr, decompressor.getBlockStats());
+    }
     return 0;
 }
+#endif
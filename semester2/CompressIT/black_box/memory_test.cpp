@@ -0,0 +1,112 @@
+// Regression test of compressor --memory-limit on a generated file:
+//     g++ -O2 -std=c++11 -pthread -o memory_test memory_test.cpp
+//     ./memory_test
+// Compresses the file under small and large limits with the options fitMemoryLimit picks,
+// then with both builders at fixed block sizes, and checks the heap peak of every run against
+// the limit or the estimate. Prints a line per run, exits with 1 if any run went over.
+#define COMPRESSIT_NO_MAIN
+#define COMPRESSIT_COUNT_HEAP
+#include "compressor.cpp"
+
+#include <random>
+
+const size_t INPUT_SIZE = 8 << 20;
+
+// Random letters, the worst case of SA-IS, with every other 64-byte piece repeating an
+// earlier one, so the blocks have long matches as well.
+string generateInput(size_t size) {
+    const string LETTERS = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    mt19937 random(1);
+    string input;
+    input.reserve(size);
+    while (input.size() < size) {
+        if (input.size() >= 64 && random() % 2 == 0) {
+            size_t start = random() % (input.size() - 63);
+            input.append(input, start, 64);
+        }
+        else {
+            for (int i = 0; i < 64; ++i) {
+                input += LETTERS[random() % LETTERS.size()];
+            }
+        }
+    }
+    input.resize(size);
+    return input;
+}
+
+void writeInput(const string &path, const string &input) {
+    OutputFileBuffer outputBuffer;
+    outputBuffer.open(path);
+    ostream outputStream(&outputBuffer);
+    outputStream.exceptions(std::ios::badbit);
+    outputStream << input;
+    outputBuffer.close();
+}
+
+// Heap peak of the whole compressor run, the test itself holds next to nothing meanwhile.
+long long measureRun(const string &inputPath, const CompressionOptions &options) {
+    runPeakHeapBytes = liveHeapBytes.load();
+    Compressor compressor;
+    compressor.compress(inputPath, "/dev/null", options);
+    return runPeakHeapBytes.load();
+}
+
+bool checkRun(const string &inputPath, const CompressionOptions &options, long long limit) {
+    long long peak = measureRun(inputPath, options);
+    bool passed = peak <= limit;
+    cout << (passed ? "ok   " : "FAIL ") << "block size " << options.blockSize << ", bwt " << options.suffarrayBuilder
+         << ", threads " << options.threads << ": heap peak " << peak << " of " << limit << endl;
+    return passed;
+}
+
+int main() {
+    char inputPath[] = "/tmp/memory_test.XXXXXX";
+    int descriptor = mkstemp(inputPath);
+    if (descriptor < 0) {
+        cerr << "cannot create the input file: " << strerror(errno) << endl;
+        return 1;
+    }
+    ::close(descriptor);
+
+    bool passed = true;
+    try {
+        writeInput(inputPath, generateInput(INPUT_SIZE));
+
+        const long long LIMITS[] = { 8 << 20, 32 << 20, 256 << 20 };
+        const int THREADS[] = { 1, 4 };
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 2; ++j) {
+                CompressionOptions options;
+                options.threads = THREADS[j];
+                options.memoryLimit = LIMITS[i];
+                if (!fitMemoryLimit(options, INPUT_SIZE)) {
+                    cout << "FAIL nothing fits in " << LIMITS[i] << endl;
+                    passed = false;
+                    continue;
+                }
+                passed = checkRun(inputPath, options, LIMITS[i]) && passed;
+            }
+        }
+
+        const string BUILDERS[] = { "sais", "doubling" };
+        const int BLOCK_SIZES[] = { 64 << 10, 900 << 10, 2 << 20 };
+        for (int i = 0; i < 2; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                for (int k = 0; k < 2; ++k) {
+                    CompressionOptions options;
+                    options.suffarrayBuilder = BUILDERS[i];
+                    options.blockSize = BLOCK_SIZES[j];
+                    options.threads = THREADS[k];
+                    long long estimate = estimateMemory(BUILDERS[i], BLOCK_SIZES[j], THREADS[k], INPUT_SIZE);
+                    passed = checkRun(inputPath, options, estimate) && passed;
+                }
+            }
+        }
+    }
+    catch (const exception &error) {
+        cerr << error.what() << endl;
+        passed = false;
+    }
+    unlink(inputPath);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,394 @@
+// Counts or locates a pattern in an archive with the FM-index sidecar of compressor --fm-index:
+//     g++ -O2 -std=c++11 -pthread -o query query.cpp
+//     ./query [--locate] ARCHIVE FM_INDEX PATTERN
+// Every block is decoded only up to its BWT, the inverse BWT never runs. Offsets are printed
+// one per line in the restored data, matches spanning several blocks are found as well.
+#define COMPRESSIT_NO_MAIN
+#include "decompressor.cpp"
+
+const string FM_INDEX_MAGIC = "CFM1";
+const int FM_INDEX_TRAILER_SIZE = 20;
+// every block is walked this far from both ends for the matches crossing its borders
+const size_t MAX_PATTERN_LENGTH = 1 << 10;
+
+// FM-index of one block over the BWT decoded from its frame. A block made of k copies of
+// a string u has k equal rows for every rotation of u, their order is up to the builder.
+// Such rows are only handled as a group, walks go from group to group and a row of a group
+// stands for the position of its rotation in u plus some multiple of the period.
+class FmIndexBlock {
+private:
+    const string *transformedText;
+    uint32_t length;
+    uint32_t period;
+    uint32_t repeats;
+    uint32_t rankInterval;
+    uint32_t sampleRate;
+    uint32_t primaryGroup;
+    int slotOf[ALPHABET_SIZE];
+    int symbolCount;
+    vector<uint32_t> rankSamples;
+    // first row of the rotations starting with every symbol
+    uint32_t firstRow[ALPHABET_SIZE + 1];
+    vector<uint64_t> sampledRows;
+    vector<uint32_t> sampledBefore;
+    vector<uint32_t> samples;
+    // previousGroup of every group, built when locating many rows
+    vector<uint32_t> previousGroups;
+
+private:
+    uint32_t rank(unsigned char symbol, uint32_t row) const;
+    uint32_t select(unsigned char symbol, uint32_t count) const;
+    uint32_t previousGroup(uint32_t group) const;
+    uint32_t nextGroup(uint32_t group) const;
+    void makePreviousGroups();
+    uint32_t locateRow(uint32_t row) const;
+    pair<uint32_t, uint32_t> findRows(const string &pattern) const;
+
+public:
+    // Reads the record of a block whose BWT and header were just decoded from the archive.
+    void load(istream &inputStream, const string &transformedText, uint32_t primaryIndex, uint32_t blockChecksum);
+    uint32_t getLength() const {
+        return length;
+    }
+    uint64_t count(const string &pattern) const;
+    // Positions of the pattern inside the block in increasing order.
+    void locate(const string &pattern, vector<uint32_t> &positions);
+    // The first and the last size bytes of the block.
+    string head(uint32_t size) const;
+    string tail(uint32_t size) const;
+};
+
+void FmIndexBlock::load(istream &inputStream, const string &transformedText, uint32_t primaryIndex,
+                        uint32_t blockChecksum) {
+    this->transformedText = &transformedText;
+    length = readUint(inputStream, 4);
+    uint32_t checksum = readUint(inputStream, 4);
+    period = readUint(inputStream, 4);
+    rankInterval = readUint(inputStream, 4);
+    sampleRate = readUint(inputStream, 4);
+    symbolCount = readUint(inputStream, 2);
+    if (!inputStream || length != transformedText.size() || checksum != blockChecksum) {
+        throw runtime_error("FM index does not belong to this archive");
+    }
+    if (rankInterval == 0 || sampleRate == 0 || symbolCount > ALPHABET_SIZE
+        || (length > 0 && (primaryIndex >= length || period == 0 || length % period != 0))) {
+        throw runtime_error("corrupted FM index record");
+    }
+    repeats = length == 0 ? 1 : length / period;
+    primaryGroup = primaryIndex / repeats;
+    previousGroups.clear();
+
+    fill(slotOf, slotOf + ALPHABET_SIZE, -1);
+    for (int slot = 0; slot < symbolCount; ++slot) {
+        int symbol = inputStream.get();
+        if (symbol < 0) {
+            throw runtime_error("FM index is truncated");
+        }
+        slotOf[symbol] = slot;
+    }
+    rankSamples.resize((size_t)(length / rankInterval + 1) * symbolCount);
+    for (size_t i = 0; i < rankSamples.size(); ++i) {
+        rankSamples[i] = readUint(inputStream, 4);
+    }
+    sampledRows.resize((length + 63) / 64);
+    sampledBefore.resize(sampledRows.size());
+    uint32_t sampledCount = 0;
+    for (size_t word = 0; word < sampledRows.size(); ++word) {
+        sampledRows[word] = readUint(inputStream, 8);
+        sampledBefore[word] = sampledCount;
+        sampledCount += __builtin_popcountll(sampledRows[word]);
+    }
+    samples.resize(readUint(inputStream, 4));
+    if (!inputStream || samples.size() != sampledCount) {
+        throw runtime_error("corrupted FM index record");
+    }
+    for (size_t i = 0; i < samples.size(); ++i) {
+        samples[i] = readUint(inputStream, 4);
+    }
+    if (!inputStream) {
+        throw runtime_error("FM index is truncated");
+    }
+
+    firstRow[0] = 0;
+    for (int symbol = 0; symbol < ALPHABET_SIZE; ++symbol) {
+        firstRow[symbol + 1] = firstRow[symbol] + rank(symbol, length);
+    }
+    if (firstRow[ALPHABET_SIZE] != length) {
+        throw runtime_error("FM index does not match the BWT of the block");
+    }
+}
+
+// Occurrences of the symbol among the first rows of the BWT.
+uint32_t FmIndexBlock::rank(unsigned char symbol, uint32_t row) const {
+    int slot = slotOf[symbol];
+    if (slot < 0) {
+        return 0;
+    }
+    uint32_t sample = row / rankInterval;
+    const char *text = transformedText->data();
+    return rankSamples[(size_t)sample * symbolCount + slot]
+        + std::count(text + (size_t)sample * rankInterval, text + row, (char)symbol);
+}
+
+// Row of the occurrence of the symbol with the given number, counting from zero.
+uint32_t FmIndexBlock::select(unsigned char symbol, uint32_t count) const {
+    int slot = slotOf[symbol];
+    uint32_t low = 0;
+    uint32_t high = length / rankInterval;
+    while (low < high) {
+        uint32_t middle = (low + high + 1) / 2;
+        if (rankSamples[(size_t)middle * symbolCount + slot] <= count) {
+            low = middle;
+        }
+        else {
+            high = middle - 1;
+        }
+    }
+    uint32_t seen = rankSamples[(size_t)low * symbolCount + slot];
+    const char *text = transformedText->data();
+    const char *position = text + (size_t)low * rankInterval;
+    while (true) {
+        position = (const char *)memchr(position, symbol, text + length - position);
+        if (position == NULL) {
+            throw runtime_error("FM index does not match the BWT of the block");
+        }
+        if (seen == count) {
+            return position - text;
+        }
+        ++seen;
+        ++position;
+    }
+}
+
+// The group of the rotation one symbol earlier in the text.
+uint32_t FmIndexBlock::previousGroup(uint32_t group) const {
+    if (!previousGroups.empty()) {
+        return previousGroups[group];
+    }
+    uint32_t row = group * repeats;
+    unsigned char symbol = (*transformedText)[row];
+    return (firstRow[symbol] + rank(symbol, row)) / repeats;
+}
+
+// The group of the rotation one symbol later in the text.
+uint32_t FmIndexBlock::nextGroup(uint32_t group) const {
+    uint32_t row = group * repeats;
+    int symbol = upper_bound(firstRow, firstRow + ALPHABET_SIZE + 1, row) - firstRow - 1;
+    return select(symbol, row - firstRow[symbol]) / repeats;
+}
+
+// One pass over the BWT instead of a rank query per step.
+void FmIndexBlock::makePreviousGroups() {
+    uint32_t seen[ALPHABET_SIZE] = {};
+    previousGroups.resize(period);
+    for (uint32_t row = 0; row < length; ++row) {
+        unsigned char symbol = (*transformedText)[row];
+        if (row % repeats == 0) {
+            previousGroups[row / repeats] = (firstRow[symbol] + seen[symbol]) / repeats;
+        }
+        ++seen[symbol];
+    }
+}
+
+uint32_t FmIndexBlock::locateRow(uint32_t row) const {
+    uint32_t group = row / repeats;
+    // every position of u is at most sampleRate steps after a sampled one
+    for (uint32_t steps = 0; steps <= std::min(sampleRate, period); ++steps) {
+        uint32_t groupRow = group * repeats;
+        uint64_t bits = sampledRows[groupRow / 64];
+        uint64_t bit = (uint64_t)1 << (groupRow % 64);
+        if (bits & bit) {
+            uint32_t sample = samples[sampledBefore[groupRow / 64] + __builtin_popcountll(bits & (bit - 1))];
+            return (sample + steps) % period + period * (row % repeats);
+        }
+        group = previousGroup(group);
+    }
+    throw runtime_error("FM index has a gap in its suffix array samples");
+}
+
+// Backward search, the rows of the rotations that start with the pattern.
+pair<uint32_t, uint32_t> FmIndexBlock::findRows(const string &pattern) const {
+    uint32_t low = 0;
+    uint32_t high = length;
+    for (size_t i = pattern.size(); i-- > 0 && low < high;) {
+        unsigned char symbol = pattern[i];
+        low = firstRow[symbol] + rank(symbol, low);
+        high = firstRow[symbol] + rank(symbol, high);
+    }
+    return make_pair(low, high);
+}
+
+// Rotations wrapping around the end of the block are not occurrences, those are the rotations
+// starting at the last pattern length - 1 positions.
+uint64_t FmIndexBlock::count(const string &pattern) const {
+    if (pattern.empty() || pattern.size() > length) {
+        return 0;
+    }
+    pair<uint32_t, uint32_t> rows = findRows(pattern);
+    if (rows.first >= rows.second) {
+        return 0;
+    }
+    uint64_t occurrences = rows.second - rows.first;
+    uint32_t group = primaryGroup;
+    for (size_t i = 1; i < pattern.size(); ++i) {
+        group = previousGroup(group);
+        if (group * repeats >= rows.first && group * repeats < rows.second) {
+            --occurrences;
+        }
+    }
+    return occurrences;
+}
+
+void FmIndexBlock::locate(const string &pattern, vector<uint32_t> &positions) {
+    positions.clear();
+    if (pattern.empty() || pattern.size() > length) {
+        return;
+    }
+    pair<uint32_t, uint32_t> rows = findRows(pattern);
+    // a walk scans about half a rank interval per step, past some point the table is cheaper
+    if (previousGroups.empty() && (uint64_t)(rows.second - rows.first) * sampleRate * rankInterval / 2 > length) {
+        makePreviousGroups();
+    }
+    for (uint32_t row = rows.first; row < rows.second; ++row) {
+        uint32_t position = locateRow(row);
+        if (position + pattern.size() <= length) {
+            positions.push_back(position);
+        }
+    }
+    sort(positions.begin(), positions.end());
+}
+
+string FmIndexBlock::head(uint32_t size) const {
+    string text;
+    uint32_t group = primaryGroup;
+    for (uint32_t i = 0; i < std::min(size, length); ++i) {
+        uint32_t row = group * repeats;
+        text.push_back((char)(upper_bound(firstRow, firstRow + ALPHABET_SIZE + 1, row) - firstRow - 1));
+        group = nextGroup(group);
+    }
+    return text;
+}
+
+string FmIndexBlock::tail(uint32_t size) const {
+    string text;
+    uint32_t group = primaryGroup;
+    for (uint32_t i = 0; i < std::min(size, length); ++i) {
+        text.push_back((*transformedText)[group * repeats]);
+        group = previousGroup(group);
+    }
+    reverse(text.begin(), text.end());
+    return text;
+}
+
+// Offsets of the FM-index records of every frame.
+vector<uint64_t> readFmIndexOffsets(istream &inputStream, size_t frameCount) {
+    inputStream.seekg(0, std::ios::end);
+    uint64_t fileSize = inputStream.tellg();
+    if (!inputStream || fileSize < FM_INDEX_TRAILER_SIZE) {
+        throw runtime_error("FM index is too short");
+    }
+    inputStream.seekg(fileSize - FM_INDEX_TRAILER_SIZE);
+    uint64_t recordCount = readUint(inputStream, 8);
+    uint64_t indexOffset = readUint(inputStream, 8);
+    string magic(FM_INDEX_MAGIC.size(), ' ');
+    inputStream.read(&magic[0], magic.size());
+    if (magic != FM_INDEX_MAGIC || indexOffset + 8 * recordCount + FM_INDEX_TRAILER_SIZE != fileSize) {
+        throw runtime_error("not an FM index");
+    }
+    if (recordCount != frameCount) {
+        throw runtime_error("FM index does not belong to this archive");
+    }
+    inputStream.seekg(indexOffset);
+    vector<uint64_t> offsets(recordCount);
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        offsets[i] = readUint(inputStream, 8);
+        if (offsets[i] >= indexOffset) {
+            throw runtime_error("FM index points outside of itself");
+        }
+    }
+    return offsets;
+}
+
+int main(int argc, char *argv[]) {
+    bool locate = false;
+    vector<string> arguments;
+    for (int i = 1; i < argc; ++i) {
+        string argument = argv[i];
+        if (argument == "--locate") {
+            locate = true;
+        }
+        else {
+            arguments.push_back(argument);
+        }
+    }
+    if (arguments.size() != 3) {
+        cerr << "usage: " << argv[0] << " [--locate] ARCHIVE FM_INDEX PATTERN" << endl;
+        return 1;
+    }
+    const string &pattern = arguments[2];
+    if (pattern.empty() || pattern.size() > MAX_PATTERN_LENGTH) {
+        cerr << "pattern must be 1 to " << MAX_PATTERN_LENGTH << " bytes long" << endl;
+        return 1;
+    }
+
+    try {
+        InputFile archive;
+        archive.open(arguments[0]);
+        Decompressor decompressor;
+        decompressor.openArchive(archive.data(), archive.size());
+        MemoryInputBuffer archiveBuffer(archive.data(), archive.size());
+        istream archiveStream(&archiveBuffer);
+
+        InputFile fmIndex;
+        fmIndex.open(arguments[1]);
+        MemoryInputBuffer fmIndexBuffer(fmIndex.data(), fmIndex.size());
+        istream fmIndexStream(&fmIndexBuffer);
+        vector<uint64_t> recordOffsets = readFmIndexOffsets(fmIndexStream, decompressor.getFrameCount());
+
+        BlockDecompressor blockDecompressor;
+        FmIndexBlock block;
+        vector<uint32_t> positions;
+        uint64_t occurrences = 0;
+        string previousTail;
+        for (size_t frame = 0; frame < decompressor.getFrameCount(); ++frame) {
+            archiveStream.seekg(decompressor.getFrameEntry(frame).offset);
+            const string &transformedText = blockDecompressor.decodeTransformedFrame(archiveStream);
+            fmIndexStream.seekg(recordOffsets[frame]);
+            block.load(fmIndexStream, transformedText, blockDecompressor.getStats().primaryIndex,
+                       blockDecompressor.getBlockChecksum());
+            uint64_t blockOffset = decompressor.getFrameOutputOffset(frame);
+
+            // matches that start in earlier blocks and end in this one, appended blocks may be
+            // shorter than the pattern, so the tail is made of the last bytes of as many as needed
+            string window = previousTail + block.head(pattern.size() - 1);
+            for (size_t start = window.find(pattern); start != string::npos && start < previousTail.size();
+                 start = window.find(pattern, start + 1)) {
+                ++occurrences;
+                if (locate) {
+                    cout << blockOffset - previousTail.size() + start << '\n';
+                }
+            }
+
+            if (locate) {
+                block.locate(pattern, positions);
+                for (size_t i = 0; i < positions.size(); ++i) {
+                    cout << blockOffset + positions[i] << '\n';
+                }
+                occurrences += positions.size();
+            }
+            else {
+                occurrences += block.count(pattern);
+            }
+            previousTail += block.tail(pattern.size() - 1);
+            previousTail.erase(0, previousTail.size() - std::min(previousTail.size(), pattern.size() - 1));
+        }
+        if (!locate) {
+            cout << occurrences << endl;
+        }
+    }
+    catch (const exception &error) {
+        cerr << error.what() << endl;
+        return 1;
+    }
+    return 0;
+}
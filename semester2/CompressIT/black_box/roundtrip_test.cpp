@@ -0,0 +1,391 @@
+// Round trips through the stages and the archive format of both binaries:
+//     g++ -O2 -std=c++11 -pthread -o roundtrip_test roundtrip_test.cpp
+//     ./roundtrip_test
+// Every case runs generated data through a stage, the archive format or an API of the
+// decompressor and checks what comes back.
+// Prints a line per case, exits with 1 if any case failed.
+#include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
+#include <exception>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+#define COMPRESSIT_NO_MAIN
+namespace compression {
+#include "compressor.cpp"
+}
+namespace decompression {
+#include "decompressor.cpp"
+}
+
+using namespace std;
+
+bool report(bool passed, const string &name) {
+    cout << (passed ? "ok   " : "FAIL ") << name << endl;
+    return passed;
+}
+
+// Symbol i appears fib(i + 1) times, the optimal code of such counts is as deep as the
+// alphabet is large.
+vector<uint16_t> generateFibonacciSymbols(int alphabetSize, mt19937 &random) {
+    vector<uint16_t> symbols;
+    long long previous = 0, count = 1;
+    for (int symbol = 0; symbol < alphabetSize; ++symbol) {
+        symbols.insert(symbols.end(), count, symbol);
+        long long next = previous + count;
+        previous = count;
+        count = next;
+    }
+    shuffle(symbols.begin(), symbols.end(), random);
+    return symbols;
+}
+
+// Codes longer than the first level of the decode table go through the subtables.
+bool testLongHaffmanCodes() {
+    mt19937 random(6);
+    vector<uint16_t> symbols = generateFibonacciSymbols(18, random);
+    compression::HaffmanCoder coder;
+    coder.code(symbols, compression::ZERO_RUN_ALPHABET_SIZE);
+    const vector<int> &codeLengths = coder.getCodeLengths();
+    int maxLength = *max_element(codeLengths.begin(), codeLengths.end());
+    ostringstream codedStream;
+    coder.outputCodedData(codedStream);
+
+    decompression::HaffmanCoder decoder;
+    istringstream codedInput(codedStream.str());
+    decoder.inputCodedData(codedInput, symbols.size());
+    decoder.decode();
+    return report(maxLength > decompression::HAFFMAN_TABLE_BITS && decoder.getDecodedText() == symbols,
+                  "haffman codes of " + to_string(maxLength) + " bits");
+}
+
+// With more symbols than a 20-bit code can tell apart by frequency, the lengths are capped
+// and still make a complete code: the Kraft sum of the used symbols is exactly one.
+bool testCappedHaffmanCodes() {
+    mt19937 random(15);
+    vector<uint16_t> symbols = generateFibonacciSymbols(30, random);
+    compression::HaffmanCoder coder;
+    coder.code(symbols, compression::ZERO_RUN_ALPHABET_SIZE);
+    const vector<int> &codeLengths = coder.getCodeLengths();
+    // in units of 2^-32, uncapped lengths would stay below 32 bits as well
+    int maxLength = 0;
+    uint64_t kraftSum = 0;
+    for (size_t symbol = 0; symbol < codeLengths.size(); ++symbol) {
+        if (codeLengths[symbol] > 0) {
+            maxLength = std::max(maxLength, codeLengths[symbol]);
+            kraftSum += (uint64_t)1 << (32 - codeLengths[symbol]);
+        }
+    }
+    ostringstream codedStream;
+    coder.outputCodedData(codedStream);
+
+    decompression::HaffmanCoder decoder;
+    istringstream codedInput(codedStream.str());
+    decoder.inputCodedData(codedInput, symbols.size());
+    decoder.decode();
+    return report(maxLength == compression::HAFFMAN_MAX_CODE_LENGTH && kraftSum == (uint64_t)1 << 32
+                  && decoder.getDecodedText() == symbols,
+                  "haffman codes capped at " + to_string(maxLength) + " bits");
+}
+
+bool testAnsRoundTrip(const string &name, const vector<uint16_t> &symbols) {
+    compression::AnsCoder coder;
+    coder.code(symbols, compression::ZERO_RUN_ALPHABET_SIZE);
+    ostringstream codedStream;
+    coder.outputCodedData(codedStream);
+
+    decompression::AnsCoder decoder;
+    istringstream codedInput(codedStream.str());
+    decoder.inputCodedData(codedInput, symbols.size());
+    decoder.decode();
+    return report(decoder.getDecodedText() == symbols, "ans " + name);
+}
+
+bool testAns() {
+    mt19937 random(11);
+    vector<uint16_t> uniform(100000);
+    for (size_t i = 0; i < uniform.size(); ++i) {
+        uniform[i] = random() % compression::ZERO_RUN_ALPHABET_SIZE;
+    }
+    bool passed = testAnsRoundTrip("one symbol", vector<uint16_t>(5000, 7));
+    passed = testAnsRoundTrip("skewed symbols", generateFibonacciSymbols(24, random)) && passed;
+    return testAnsRoundTrip("whole alphabet", uniform) && passed;
+}
+
+// Words over a small vocabulary, so blocks have long matches like real text.
+string generateText(size_t size, mt19937 &random) {
+    vector<string> vocabulary(500);
+    for (size_t i = 0; i < vocabulary.size(); ++i) {
+        int length = 1 + random() % 9;
+        for (int j = 0; j < length; ++j) {
+            vocabulary[i] += (char)('a' + random() % 26);
+        }
+    }
+    string text;
+    while (text.size() < size) {
+        text += vocabulary[random() % vocabulary.size()];
+        text += random() % 12 == 0 ? '\n' : ' ';
+    }
+    text.resize(size);
+    return text;
+}
+
+bool testBwt(const string &name, const string &block) {
+    compression::BarrowsWillerTransformator transformator;
+    string transformed = transformator.transform(block);
+    const vector<int> &walkStarts = transformator.getWalkStarts();
+    decompression::BarrowsWillerTransformator inverse;
+    inverse.setWalkStarts(vector<uint32_t>(walkStarts.begin(), walkStarts.end()));
+    return report(inverse.decode(transformed) == block, "bwt " + name);
+}
+
+// Blocks shorter than the count of walks, periodic ones and one past 16M, whose rows no
+// longer fit into 32 bits.
+bool testBwtWalks() {
+    mt19937 random(12);
+    bool passed = true;
+    for (int length = 2; length <= 20; length += 3) {
+        passed = testBwt("of " + to_string(length) + " bytes", generateText(length, random)) && passed;
+    }
+    passed = testBwt("of a periodic block", string(1000, 'x') + "y" + string(1000, 'x') + "y") && passed;
+    passed = testBwt("of 100K", generateText(100000, random)) && passed;
+    return testBwt("of 17M", generateText(17 << 20, random)) && passed;
+}
+
+// Known answers from RFC 3720 and the usual check string, on both ways of computing.
+bool testCrc32c() {
+    string counting(32, '\0'), ones(32, '\xFF');
+    for (int i = 0; i < 32; ++i) {
+        counting[i] = (char)i;
+    }
+    const string INPUTS[] = { "123456789", string(32, '\0'), ones, counting, "" };
+    const uint32_t CHECKS[] = { 0xE3069283, 0x8A9136AA, 0x62A8AB43, 0x46DD794E, 0 };
+    bool passed = true;
+    for (int hardware = 0; hardware < 2; ++hardware) {
+        compression::Crc32c crc32c(hardware == 1);
+        bool matched = true;
+        for (int i = 0; i < 5; ++i) {
+            matched = matched && crc32c.compute(INPUTS[i].data(), INPUTS[i].size()) == CHECKS[i];
+        }
+        passed = report(matched, hardware == 1 ? "crc32c with sse4.2 if there" : "crc32c with tables") && passed;
+    }
+    return passed;
+}
+
+string compressToString(const string &data, const compression::CompressionOptions &options) {
+    vector<uint8_t> archive;
+    compression::compressBuffer((const uint8_t *)data.data(), data.size(), archive, options);
+    return string(archive.begin(), archive.end());
+}
+
+// Reads of odd sizes, most of them end inside a frame and the next one starts there.
+bool testStreamReads() {
+    mt19937 random(20);
+    string data = generateText(300000, random);
+    compression::CompressionOptions options;
+    options.blockSize = compression::MIN_BLOCK_SIZE;
+    string archive = compressToString(data, options);
+
+    decompression::DecompressionStream stream;
+    stream.open(archive.data(), archive.size());
+    string restored;
+    vector<char> buffer(5000);
+    while (true) {
+        size_t count = stream.read(buffer.data(), 1 + random() % buffer.size());
+        if (count == 0) {
+            break;
+        }
+        restored.append(buffer.data(), count);
+    }
+    return report(restored == data, "stream reads across frames");
+}
+
+bool testRangeReads() {
+    mt19937 random(22);
+    string data = generateText(300000, random);
+    compression::CompressionOptions options;
+    options.blockSize = compression::MIN_BLOCK_SIZE;
+    string archive = compressToString(data, options);
+
+    decompression::Decompressor decompressor;
+    decompressor.openArchive(archive.data(), archive.size());
+    bool passed = true;
+    vector<char> buffer(10000);
+    for (int i = 0; i < 200; ++i) {
+        uint64_t offset = random() % (data.size() + 1);
+        size_t length = random() % buffer.size();
+        size_t count = decompressor.read(offset, buffer.data(), length);
+        passed = passed && string(buffer.data(), count) == data.substr(offset, length);
+    }
+    // the end of the data and past it
+    size_t count = decompressor.read(data.size() - 10, buffer.data(), 100);
+    passed = passed && string(buffer.data(), count) == data.substr(data.size() - 10);
+    passed = passed && decompressor.read(data.size() + 5, buffer.data(), 100) == 0;
+    return report(passed, "range reads across frames");
+}
+
+// Empty records, records spread over several blocks and many in one block.
+bool testRecords() {
+    mt19937 random(23);
+    vector<string> records;
+    for (int i = 0; i < 500; ++i) {
+        size_t size = random() % 5 == 0 ? random() % 5000 : random() % 100;
+        records.push_back(generateText(size, random));
+    }
+    compression::CompressionOptions options;
+    options.blockSize = compression::MIN_BLOCK_SIZE;
+    string archive;
+    compression::StringOutputBuffer archiveBuffer(archive);
+    ostream archiveStream(&archiveBuffer);
+    compression::RecordBatchCompressor batchCompressor(archiveStream, options);
+    for (size_t i = 0; i < records.size(); ++i) {
+        batchCompressor.addRecord((const uint8_t *)records[i].data(), records[i].size());
+    }
+    batchCompressor.finish();
+
+    decompression::Decompressor decompressor;
+    decompressor.openArchive(archive.data(), archive.size());
+    bool passed = decompressor.getRecordCount() == records.size();
+    string record;
+    for (size_t i = 0; passed && i < records.size(); ++i) {
+        size_t index = random() % records.size();
+        decompressor.readRecord(index, record);
+        passed = record == records[index];
+    }
+    return report(passed, "record lookup");
+}
+
+string readFile(const string &path) {
+    ifstream inputStream(path.c_str(), std::ios::binary);
+    ostringstream contents;
+    contents << inputStream.rdbuf();
+    return contents.str();
+}
+
+void writeFile(const string &path, const string &data) {
+    ofstream outputStream(path.c_str(), std::ios::binary | std::ios::trunc);
+    outputStream << data;
+    if (!outputStream.flush()) {
+        throw runtime_error("cannot write " + path);
+    }
+}
+
+string makeTemporaryPath() {
+    char path[] = "/tmp/roundtrip_test.XXXXXX";
+    int descriptor = mkstemp(path);
+    if (descriptor < 0) {
+        throw runtime_error(string("cannot create a temporary file: ") + strerror(errno));
+    }
+    ::close(descriptor);
+    return path;
+}
+
+// Frames, the index and the trailer and nothing else: the index starts where the frames end.
+bool isCompact(const string &archive) {
+    decompression::Decompressor decompressor;
+    decompressor.openArchive(archive.data(), archive.size());
+    uint64_t framesSize = 0;
+    for (size_t i = 0; i < decompressor.getFrameCount(); ++i) {
+        framesSize += decompressor.getFrameEntry(i).size;
+    }
+    return archive.size() == framesSize + 24 * decompressor.getFrameCount() + decompression::ARCHIVE_TRAILER_SIZE;
+}
+
+// Many small appends restore to everything appended and leave no old index behind. An archive
+// with an FM index does not grow without it.
+bool testAppends() {
+    mt19937 random(24);
+    string inputPath = makeTemporaryPath(), archivePath = makeTemporaryPath(), fmIndexPath = makeTemporaryPath();
+    bool passed = true;
+    try {
+        compression::CompressionOptions options;
+        options.blockSize = 4 << 10;
+        string expected = generateText(50000, random);
+        writeFile(inputPath, expected);
+        compression::Compressor().compress(inputPath, archivePath, options);
+        options.append = true;
+        for (int i = 0; i < 50; ++i) {
+            string line = "line " + to_string(i) + " " + generateText(random() % 100, random) + "\n";
+            writeFile(inputPath, line);
+            compression::Compressor().compress(inputPath, archivePath, options);
+            expected += line;
+        }
+        string archive = readFile(archivePath);
+        vector<uint8_t> restored;
+        decompression::decompressBuffer((const uint8_t *)archive.data(), archive.size(), restored);
+        passed = report(string(restored.begin(), restored.end()) == expected && isCompact(archive),
+                        "50 appends, archive of " + to_string(archive.size()) + " bytes") && passed;
+
+        options.append = false;
+        options.fmIndexPath = fmIndexPath;
+        compression::Compressor().compress(inputPath, archivePath, options);
+        string indexed = readFile(archivePath);
+        options.append = true;
+        options.fmIndexPath = "";
+        bool refused = false;
+        try {
+            compression::Compressor().compress(inputPath, archivePath, options);
+        }
+        catch (const exception &) {
+            refused = true;
+        }
+        passed = report(refused && readFile(archivePath) == indexed, "append without the fm index refused") && passed;
+    }
+    catch (...) {
+        unlink(inputPath.c_str());
+        unlink(archivePath.c_str());
+        unlink(fmIndexPath.c_str());
+        throw;
+    }
+    unlink(inputPath.c_str());
+    unlink(archivePath.c_str());
+    unlink(fmIndexPath.c_str());
+    return passed;
+}
+
+int main() {
+    bool passed = true;
+    try {
+        passed = testLongHaffmanCodes() && passed;
+        passed = testCappedHaffmanCodes() && passed;
+        passed = testAns() && passed;
+        passed = testBwtWalks() && passed;
+        passed = testCrc32c() && passed;
+        passed = testStreamReads() && passed;
+        passed = testRangeReads() && passed;
+        passed = testRecords() && passed;
+        passed = testAppends() && passed;
+    }
+    catch (const exception &error) {
+        cerr << error.what() << endl;
+        passed = false;
+    }
+    return passed ? 0 : 1;
+}